@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * keyed_thread_pool.h
+ *
+ * A pool of worker threads that runs tasks posted with the same key
+ * one after another, in the order they were posted, while tasks with
+ * different keys run in parallel.
+ */
+
+#ifndef KEYED_THREAD_POOL_H_
+#define KEYED_THREAD_POOL_H_
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <deque>
+#include <string>
+#include <stdint.h>
+
+namespace interactive_markers
+{
+
+struct KeyedThreadPoolStats
+{
+  KeyedThreadPoolStats() :
+    posted(0), completed(0), coalesced(0), queued(0), max_queued(0), blocked_posts(0) {}
+
+  // number of tasks handed to post() and number of tasks that have finished
+  uint64_t posted;
+  uint64_t completed;
+
+  // number of tasks that were dropped because a newer one replaced them
+  uint64_t coalesced;
+
+  // number of tasks currently waiting for a worker, and the maximum so far
+  std::size_t queued;
+  std::size_t max_queued;
+
+  // number of calls to post() that had to wait because the queue was full
+  uint64_t blocked_posts;
+};
+
+class KeyedThreadPool : boost::noncopyable
+{
+public:
+
+  typedef boost::function< void () > Task;
+
+  // @param num_threads  number of worker threads (at least one is started)
+  // @param max_queued   number of waiting tasks at which post() starts to block, 0 for no limit
+  KeyedThreadPool( unsigned int num_threads, std::size_t max_queued );
+
+  // runs all tasks that are still queued, then joins the workers
+  ~KeyedThreadPool();
+
+  // Run the task after all tasks previously posted with the same key have finished.
+  // Blocks while the queue is full, so it must not be called from a task.
+  // If replaceable is set and the last task waiting for the same key is replaceable
+  // as well, the new task takes its place instead of being queued behind it.
+  void post( const std::string &key, const Task &task, bool replaceable = false );
+
+  // block until all posted tasks have finished
+  void waitIdle();
+
+  KeyedThreadPoolStats getStats() const;
+
+private:
+
+  void workerThread();
+
+  struct QueuedTask
+  {
+    Task task;
+    bool replaceable;
+  };
+
+  // A key is in this map while it has tasks that are queued or running.
+  // Only one worker at a time takes tasks from a queue.
+  typedef boost::unordered_map< std::string, std::deque<QueuedTask> > M_TaskQueue;
+  M_TaskQueue queues_;
+
+  // keys whose next task can be started, in the order they became ready
+  std::deque<std::string> ready_keys_;
+
+  std::size_t num_running_;
+  std::size_t max_queued_;
+  bool shutdown_;
+
+  KeyedThreadPoolStats stats_;
+
+  mutable boost::mutex mutex_;
+  boost::condition_variable work_cond_;
+  boost::condition_variable space_cond_;
+  boost::condition_variable idle_cond_;
+
+  boost::thread_group threads_;
+};
+
+}
+
+#endif /* KEYED_THREAD_POOL_H_ */
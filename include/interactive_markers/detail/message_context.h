@@ -37,6 +37,8 @@
 #ifndef MESSAGE_CONTEXT_H_
 #define MESSAGE_CONTEXT_H_
 
+#include "transform_cache.h"
+
 #include <tf2_ros/buffer.h>
 
 #include <visualization_msgs/InteractiveMarkerInit.h>
@@ -49,17 +51,21 @@ template<class MsgT>
 class MessageContext
 {
 public:
-  MessageContext( tf2_ros::Buffer& tf,
+  // @param transforms  tf lookups go through this, see TransformCache
+  MessageContext( TransformCache& transforms,
       const std::string& target_frame,
       const typename MsgT::ConstPtr& msg,
       bool enable_autocomplete_transparency = true);
 
   MessageContext<MsgT>& operator=( const MessageContext<MsgT>& other );
 
-  // transform all messages with timestamp into target frame
+  // transform all messages with timestamp into target frame.
+  // Does nothing while the missing transforms have not arrived.
   void getTfTransforms();
 
-  typename MsgT::Ptr msg;
+  // The original message until something in it has to be changed,
+  // then a copy of it, see writableMsg()
+  typename MsgT::ConstPtr msg;
 
   // return true if tf info is complete
   bool isReady();
@@ -68,17 +74,51 @@ private:
 
   void init();
 
+  // true if none of the transforms missing in the last call to getTfTransforms()
+  // can have arrived since, see TransformCache::requestNotification()
+  bool isWaitingForTf() const;
+
+  // remember the state of tf before trying to get the missing transforms
+  void beginTfAttempt();
+
+  // ask to be notified when the transform for the header arrives
+  void requestTf( const std_msgs::Header& header );
+
+  // copy the message on the first call, so that it can be modified
+  MsgT& writableMsg();
+
+  // true if the pose has to be transformed into the target frame
+  bool needsTransform( const std_msgs::Header& header ) const;
+  bool needsTransform( const visualization_msgs::InteractiveMarker& int_marker ) const;
+
+  // look up the transform for the header
+  // @return false if it is not available yet
+  bool lookupTransform( const std_msgs::Header& header, geometry_msgs::TransformStamped& transform );
+
+  // transform the pose into the target frame if needed
   bool getTransform( std_msgs::Header& header, geometry_msgs::Pose& pose_msg );
+  // only check if the transform is available, for poses that don't need to be transformed
+  bool getTransform( const std_msgs::Header& header, const geometry_msgs::Pose& pose_msg );
+
+  // transform an interactive marker and the markers in its controls,
+  // IntMarkerT is const if nothing has to be transformed
+  template<class IntMarkerT>
+  bool getTransforms( IntMarkerT& int_marker );
 
-  void getTfTransforms( std::vector<visualization_msgs::InteractiveMarker>& msg_vec, std::list<size_t>& indices );
-  void getTfTransforms( std::vector<visualization_msgs::InteractiveMarkerPose>& msg_vec, std::list<size_t>& indices );
+  void getTfTransforms( std::vector<visualization_msgs::InteractiveMarker> MsgT::*markers, std::list<size_t>& indices );
+  void getTfTransforms( std::vector<visualization_msgs::InteractiveMarkerPose> MsgT::*poses, std::list<size_t>& indices );
 
   // array indices of marker/pose updates with missing tf info
   std::list<size_t> open_marker_idx_;
   std::list<size_t> open_pose_idx_;
-  tf2_ros::Buffer& tf_;
+  // set once msg has been copied
+  typename MsgT::Ptr writable_msg_;
+  TransformCache& transforms_;
   std::string target_frame_;
   bool enable_autocomplete_transparency_;
+  // see isWaitingForTf
+  bool tf_requested_;
+  uint64_t num_tf_notifications_;
 };
 
 class InitFailException: public tf2::TransformException
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * mpsc_queue.h
+ *
+ * Unbounded queue for many producers and a single consumer
+ * (after Dmitry Vyukov's non-intrusive MPSC node-based queue).
+ * It is lock-free apart from allocation: pushing allocates a node and copies
+ * the value into it, which may take the allocator's locks, and then takes
+ * one atomic exchange and one store.
+ */
+
+#ifndef MPSC_QUEUE_H_
+#define MPSC_QUEUE_H_
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <utility>
+
+namespace interactive_markers
+{
+
+// T has to be default constructible
+template<class T>
+class MpscQueue : boost::noncopyable
+{
+public:
+
+  MpscQueue() :
+    head_( new Node() )
+  {
+    tail_ = head_.load( boost::memory_order_relaxed );
+  }
+
+  ~MpscQueue()
+  {
+    while ( tail_ )
+    {
+      Node *next = tail_->next.load( boost::memory_order_relaxed );
+      delete tail_;
+      tail_ = next;
+    }
+  }
+
+  // can be called from any thread
+  void push( const T &value )
+  {
+    Node *node = new Node( value );
+    Node *prev = head_.exchange( node, boost::memory_order_acq_rel );
+    // until this store, the consumer does not see the node (nor any pushed after it)
+    prev->next.store( node, boost::memory_order_release );
+  }
+
+  // Must only be called by one thread at a time.
+  // May return false while a push is in progress, even if other values
+  // have been pushed after it.
+  bool pop( T &value )
+  {
+    Node *next = tail_->next.load( boost::memory_order_acquire );
+    if ( !next )
+    {
+      return false;
+    }
+    // next becomes the new stub node
+    value = std::move( next->value );
+    delete tail_;
+    tail_ = next;
+    return true;
+  }
+
+  // Only reliable on the consumer side, and only as a hint
+  bool empty() const
+  {
+    return tail_->next.load( boost::memory_order_acquire ) == 0;
+  }
+
+private:
+
+  struct Node
+  {
+    Node() : next( 0 ) {}
+    explicit Node( const T &value ) : next( 0 ), value( value ) {}
+
+    boost::atomic<Node*> next;
+    T value;
+  };
+
+  // most recently pushed node, shared by the producers
+  boost::atomic<Node*> head_;
+
+  // stub node in front of the oldest value, owned by the consumer
+  Node *tail_;
+};
+
+}
+
+#endif /* MPSC_QUEUE_H_ */
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * shared_marker.h
+ *
+ * Server-side representation of interactive markers that share their
+ * (potentially large) contents between pending state, committed state
+ * and outgoing messages. The message structs below are never received,
+ * they only serialize into the wire format of their visualization_msgs
+ * counterparts.
+ */
+
+#ifndef SHARED_MARKER_H_
+#define SHARED_MARKER_H_
+
+#include <visualization_msgs/InteractiveMarker.h>
+#include <visualization_msgs/InteractiveMarkerInit.h>
+#include <visualization_msgs/InteractiveMarkerPose.h>
+#include <visualization_msgs/InteractiveMarkerUpdate.h>
+
+#include <ros/message_traits.h>
+#include <ros/serialization.h>
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace interactive_markers
+{
+
+inline bool isSameHeader( const std_msgs::Header &a, const std_msgs::Header &b )
+{
+  return a.seq == b.seq && a.stamp == b.stamp && a.frame_id == b.frame_id;
+}
+
+inline bool isSamePose( const geometry_msgs::Pose &a, const geometry_msgs::Pose &b )
+{
+  return a.position.x == b.position.x && a.position.y == b.position.y && a.position.z == b.position.z &&
+      a.orientation.x == b.orientation.x && a.orientation.y == b.orientation.y &&
+      a.orientation.z == b.orientation.z && a.orientation.w == b.orientation.w;
+}
+
+// An interactive marker whose immutable contents are shared.
+// Header and pose change independently, so they are kept outside of it;
+// the ones inside int_marker are ignored.
+struct SharedMarker
+{
+  visualization_msgs::InteractiveMarkerConstPtr int_marker;
+  std_msgs::Header header;
+  geometry_msgs::Pose pose;
+
+  const std::string& name() const { return int_marker->name; }
+
+  // write a complete copy into the given message
+  void copyTo( visualization_msgs::InteractiveMarker &out ) const
+  {
+    out = *int_marker;
+    out.header = header;
+    out.pose = pose;
+  }
+
+  // the complete marker. Only makes a copy if header or pose
+  // have changed since int_marker was created.
+  visualization_msgs::InteractiveMarkerConstPtr toMessage() const
+  {
+    if ( isInSync() )
+    {
+      return int_marker;
+    }
+    visualization_msgs::InteractiveMarkerPtr out( new visualization_msgs::InteractiveMarker() );
+    copyTo( *out );
+    return out;
+  }
+
+  // true if header and pose match the ones inside int_marker
+  bool isInSync() const
+  {
+    return isSameHeader( int_marker->header, header ) && isSamePose( int_marker->pose, pose );
+  }
+};
+
+// Everything of an interactive marker except header and pose.
+// Serializes like the corresponding part of visualization_msgs::InteractiveMarker.
+struct MarkerContents
+{
+  explicit MarkerContents( const visualization_msgs::InteractiveMarker &int_marker ) : int_marker(int_marker) {}
+  const visualization_msgs::InteractiveMarker &int_marker;
+};
+
+// 64 bit FNV-1a hash over the serialized contents (see MarkerContents) of a marker.
+// Never returns zero, so that can be used for "no hash".
+// @param buffer  scratch space for serialization, kept between calls to save allocations
+uint64_t hashMarkerContents( const visualization_msgs::InteractiveMarker &int_marker, std::vector<uint8_t> &buffer );
+
+// true if both markers have the same serialized contents (see MarkerContents),
+// to rule out hash collisions
+// @param buffer  scratch space for serialization, kept between calls to save allocations
+bool isSameMarkerContents( const visualization_msgs::InteractiveMarker &a,
+    const visualization_msgs::InteractiveMarker &b, std::vector<uint8_t> &buffer );
+
+// Same layout as visualization_msgs::InteractiveMarkerInit
+struct SharedMarkerInit
+{
+  std::string server_id;
+  uint64_t seq_num;
+  std::vector<SharedMarker> markers;
+};
+
+// Same layout as visualization_msgs::InteractiveMarkerUpdate
+struct SharedMarkerUpdate
+{
+  std::string server_id;
+  uint64_t seq_num;
+  uint8_t type;
+  std::vector<SharedMarker> markers;
+  std::vector<visualization_msgs::InteractiveMarkerPose> poses;
+  std::vector<std::string> erases;
+};
+
+}
+
+namespace ros
+{
+namespace message_traits
+{
+
+// Publishers check these against the advertised type,
+// so they have to be the ones of the actual messages.
+#define INTERACTIVE_MARKERS_SHARED_MSG_TRAITS( SHARED, MSG ) \
+  template<> struct MD5Sum<SHARED> \
+  { \
+    static const char* value() { return MD5Sum<MSG>::value(); } \
+    static const char* value( const SHARED& ) { return value(); } \
+  }; \
+  template<> struct DataType<SHARED> \
+  { \
+    static const char* value() { return DataType<MSG>::value(); } \
+    static const char* value( const SHARED& ) { return value(); } \
+  }; \
+  template<> struct Definition<SHARED> \
+  { \
+    static const char* value() { return Definition<MSG>::value(); } \
+    static const char* value( const SHARED& ) { return value(); } \
+  };
+
+INTERACTIVE_MARKERS_SHARED_MSG_TRAITS( interactive_markers::SharedMarker, visualization_msgs::InteractiveMarker )
+INTERACTIVE_MARKERS_SHARED_MSG_TRAITS( interactive_markers::SharedMarkerInit, visualization_msgs::InteractiveMarkerInit )
+INTERACTIVE_MARKERS_SHARED_MSG_TRAITS( interactive_markers::SharedMarkerUpdate, visualization_msgs::InteractiveMarkerUpdate )
+
+#undef INTERACTIVE_MARKERS_SHARED_MSG_TRAITS
+
+}
+
+namespace serialization
+{
+
+template<> struct Serializer<interactive_markers::SharedMarker>
+{
+  template<typename Stream> inline static void write( Stream& stream, const interactive_markers::SharedMarker& m )
+  {
+    stream.next( m.header );
+    stream.next( m.pose );
+    stream.next( m.int_marker->name );
+    stream.next( m.int_marker->description );
+    stream.next( m.int_marker->scale );
+    stream.next( m.int_marker->menu_entries );
+    stream.next( m.int_marker->controls );
+  }
+
+  inline static uint32_t serializedLength( const interactive_markers::SharedMarker& m )
+  {
+    LStream stream;
+    write( stream, m );
+    return stream.getLength();
+  }
+};
+
+template<> struct Serializer<interactive_markers::MarkerContents>
+{
+  template<typename Stream> inline static void write( Stream& stream, const interactive_markers::MarkerContents& m )
+  {
+    stream.next( m.int_marker.name );
+    stream.next( m.int_marker.description );
+    stream.next( m.int_marker.scale );
+    stream.next( m.int_marker.menu_entries );
+    stream.next( m.int_marker.controls );
+  }
+
+  inline static uint32_t serializedLength( const interactive_markers::MarkerContents& m )
+  {
+    LStream stream;
+    write( stream, m );
+    return stream.getLength();
+  }
+};
+
+template<> struct Serializer<interactive_markers::SharedMarkerInit>
+{
+  template<typename Stream> inline static void write( Stream& stream, const interactive_markers::SharedMarkerInit& m )
+  {
+    stream.next( m.server_id );
+    stream.next( m.seq_num );
+    stream.next( m.markers );
+  }
+
+  inline static uint32_t serializedLength( const interactive_markers::SharedMarkerInit& m )
+  {
+    LStream stream;
+    write( stream, m );
+    return stream.getLength();
+  }
+};
+
+template<> struct Serializer<interactive_markers::SharedMarkerUpdate>
+{
+  template<typename Stream> inline static void write( Stream& stream, const interactive_markers::SharedMarkerUpdate& m )
+  {
+    stream.next( m.server_id );
+    stream.next( m.seq_num );
+    stream.next( m.type );
+    stream.next( m.markers );
+    stream.next( m.poses );
+    stream.next( m.erases );
+  }
+
+  inline static uint32_t serializedLength( const interactive_markers::SharedMarkerUpdate& m )
+  {
+    LStream stream;
+    write( stream, m );
+    return stream.getLength();
+  }
+};
+
+}
+}
+
+#endif /* SHARED_MARKER_H_ */
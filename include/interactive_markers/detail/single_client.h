@@ -50,8 +50,12 @@
 #include <tf2_ros/buffer.h>
 
 #include <deque>
+#include <map>
+#include <string>
+#include <vector>
 
 #include "message_context.h"
+#include "transform_cache.h"
 #include "state_machine.h"
 #include "../interactive_marker_client.h"
 
@@ -65,7 +69,7 @@ public:
 
   SingleClient(
       const std::string& server_id,
-      tf2_ros::Buffer& tf,
+      TransformCache& transforms,
       const std::string& target_frame,
       const InteractiveMarkerClient::CbCollection& callbacks );
 
@@ -77,12 +81,23 @@ public:
   // Process message from the init channel
   void process(const visualization_msgs::InteractiveMarkerInit::ConstPtr& msg, bool enable_autocomplete_transparency = true);
 
+  // Accept updates that arrive out of order, as long as the gaps are filled
+  // within a second. Needed when the server sends on several channels,
+  // which share one sequence.
+  void enableReordering();
+
   // true if INIT messages are not needed anymore
   bool isInitialized();
 
   // transform all messages with missing transforms
   void update();
 
+  // The two halves of update(). updateTf() only works on the message queues
+  // and does not call any callbacks, so it can run concurrently for different
+  // servers. Errors are reported by the call to deliver() that follows it.
+  void updateTf();
+  void deliver();
+
 private:
 
   // check if we can go from init state to normal operation
@@ -90,6 +105,19 @@ private:
 
   void checkKeepAlive();
 
+  // reset if updates have been waiting for a missing predecessor for too long
+  void checkMissingUpdates();
+
+  // queue an update that is next in sequence
+  void processInOrder(const visualization_msgs::InteractiveMarkerUpdate::ConstPtr& msg, bool enable_autocomplete_transparency);
+
+  // keep an update (or keep-alive) that is ahead of sequence until its predecessors arrive
+  // @param replace  replace a buffered message with the same sequence number
+  void bufferUpdate(const visualization_msgs::InteractiveMarkerUpdate::ConstPtr& msg, bool replace);
+
+  // process the buffered updates that have become next in sequence
+  void processBufferedUpdates(bool enable_autocomplete_transparency);
+
   enum StateT
   {
     INIT,
@@ -105,6 +133,9 @@ private:
 
   void pushUpdates();
 
+  // call the callbacks for the errors that updateTf() ran into
+  void reportTfErrors();
+
   void errorReset( std::string error_msg );
 
   // sequence number and time of first ever received update
@@ -131,7 +162,12 @@ private:
   // queue for init messages
   M_InitMessageContext init_queue_;
 
-  tf2_ros::Buffer& tf_;
+  // errors of the last updateTf(): warnings about init messages,
+  // and the reason to reset if an update could not be transformed
+  std::vector<std::string> init_tf_warnings_;
+  std::string tf_reset_error_;
+
+  TransformCache& transforms_;
   std::string target_frame_;
 
   const InteractiveMarkerClient::CbCollection& callbacks_;
@@ -139,6 +175,20 @@ private:
   std::string server_id_;
 
   bool warn_keepalive_;
+
+  // see enableReordering
+  bool reorder_;
+
+  struct BufferedUpdate
+  {
+    visualization_msgs::InteractiveMarkerUpdate::ConstPtr msg;
+    ros::Time arrival_time;
+  };
+
+  // updates that arrived ahead of their predecessors, by sequence number,
+  // and the time the oldest of them has been waiting since
+  std::map< uint64_t, BufferedUpdate > out_of_order_updates_;
+  ros::Time out_of_order_since_;
 };
 
 }
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * spatial_grid.h
+ *
+ * Uniform grid over points in several coordinate frames, for finding
+ * the points inside a region without looking at all of them.
+ */
+
+#ifndef SPATIAL_GRID_H_
+#define SPATIAL_GRID_H_
+
+#include <boost/unordered_map.hpp>
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace interactive_markers
+{
+
+class SpatialGrid
+{
+public:
+
+  // @param cell_size  edge length of the cubic cells. Should be in the
+  //                   order of the size of typical queries.
+  explicit SpatialGrid( double cell_size );
+
+  // insert a point or move it to a new position. Ids should be small
+  // integers, as they index a vector.
+  void update( uint32_t id, const std::string &frame_id, double x, double y, double z );
+
+  void remove( uint32_t id );
+
+  void clear();
+
+  // append the ids of all points in the given frame within the axis-aligned box (inclusive)
+  void queryBox( const std::string &frame_id, double min_x, double min_y, double min_z,
+      double max_x, double max_y, double max_z, std::vector<uint32_t> &ids ) const;
+
+  // append the ids of all points in the given frame within the sphere (inclusive)
+  void queryRadius( const std::string &frame_id, double x, double y, double z, double radius,
+      std::vector<uint32_t> &ids ) const;
+
+  std::size_t size() const { return size_; }
+
+private:
+
+  struct CellKey
+  {
+    uint32_t frame;
+    int64_t x, y, z;
+    bool operator==( const CellKey &other ) const
+    {
+      return frame == other.frame && x == other.x && y == other.y && z == other.z;
+    }
+  };
+
+  struct CellKeyHash
+  {
+    std::size_t operator()( const CellKey &key ) const;
+  };
+
+  struct Entry
+  {
+    Entry() : valid(false) {}
+    bool valid;
+    CellKey cell;
+    double x, y, z;
+    // position in the id list of the cell
+    std::size_t cell_index;
+  };
+
+  int64_t cellCoordinate( double value ) const;
+
+  // calls visitor( id, x, y, z ) for the points in all cells overlapping the box
+  template<class Visitor>
+  void visitCells( uint32_t frame, double min_x, double min_y, double min_z,
+      double max_x, double max_y, double max_z, Visitor &visitor ) const;
+
+  double cell_size_;
+
+  // frames are numbered in the order they first appear
+  boost::unordered_map<std::string, uint32_t> frames_;
+
+  boost::unordered_map< CellKey, std::vector<uint32_t>, CellKeyHash > cells_;
+
+  // indexed by id
+  std::vector<Entry> entries_;
+  std::size_t size_;
+};
+
+}
+
+#endif /* SPATIAL_GRID_H_ */
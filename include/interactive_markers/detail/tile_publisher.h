@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * tile_publisher.h
+ *
+ * Splits the updates of a server into square tiles of the x-y plane and
+ * publishes each tile as if it were a server of its own, so that clients
+ * can limit themselves to the area they are interested in.
+ */
+
+#ifndef TILE_PUBLISHER_H_
+#define TILE_PUBLISHER_H_
+
+#include "shared_marker.h"
+
+#include <ros/node_handle.h>
+#include <ros/publisher.h>
+#include <ros/time.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+namespace interactive_markers
+{
+
+class TilePublisher
+{
+  struct Tile;
+
+public:
+
+  // the update for one tile resulting from a server update
+  struct TileMessages
+  {
+    boost::shared_ptr<Tile> tile;
+    SharedMarkerUpdate update;
+  };
+
+  typedef std::vector<TileMessages> Batch;
+
+  // snapshots of the state of the tiles that have changed
+  typedef std::vector< std::pair< boost::shared_ptr<Tile>, SharedMarkerInit > > InitBatch;
+
+  // @param topic_ns   the tiles are published on topic_ns/tiles/<name>/update(_full)
+  // @param server_id  the tiles use server_id/<name> as their server id
+  // @param init_connect_cb  called when a client subscribes to the init topic of a tile
+  // @param empty_tile_timeout  time after which empty tiles are shut down, see sendKeepAlive()
+  TilePublisher( ros::NodeHandle &node_handle, const std::string &topic_ns,
+      const std::string &server_id, double tile_size,
+      const ros::SubscriberStatusCallback &init_connect_cb, double empty_tile_timeout );
+
+  // Split an update into updates for the tiles it affects & apply it to their state.
+  // Markers moving to another tile are erased from the old one and sent in full on the new one.
+  // Has to be called in the order in which the updates are sent to the clients.
+  boost::shared_ptr<Batch> route( const SharedMarkerUpdate &update );
+
+  // publish the result of route()
+  void send( const boost::shared_ptr<Batch> &batch );
+
+  // Publish the state of the tiles that have changed since their state was last
+  // published. Only call this once the updates leading to that state have been sent.
+  void sendChangedInits();
+
+  // Same as sendChangedInits(), for sending from another thread later on:
+  // copies the state of the changed tiles, to be published by sendInits()
+  boost::shared_ptr<InitBatch> takeChangedInits();
+  void sendInits( const boost::shared_ptr<InitBatch> &inits );
+
+  // Send keep-alives to all tiles. Tiles that have been empty for longer than
+  // the timeout get their state a last time and are shut down instead.
+  void sendKeepAlive();
+
+  double getTileSize() const { return tile_size_; }
+  double getEmptyTileTimeout() const { return empty_tile_timeout_; }
+
+  // number of tiles with advertised topics
+  std::size_t getNumTiles();
+
+private:
+
+  typedef std::pair<int, int> TileIndex;
+
+  struct Tile
+  {
+    ros::Publisher update_pub;
+    ros::Publisher init_pub;
+    // The markers currently in this tile, patched by route(). Its sequence number
+    // is the one of the last routed update, which need not have been sent yet.
+    SharedMarkerInit init;
+    boost::unordered_map<std::string, std::size_t> marker_indices;
+    // true if init has changed since it was last published
+    bool init_dirty;
+    // sequence number of the last update sent, for the keep-alives
+    uint64_t sent_seq_num;
+    // when the last marker has left the tile, zero while it has markers
+    ros::WallTime empty_since;
+  };
+
+  typedef boost::shared_ptr<Tile> TilePtr;
+
+  // tile containing the position, advertised on first use
+  TilePtr getTile( const geometry_msgs::Point &position );
+
+  // the messages for the tile in batch, added if necessary
+  TileMessages& getMessages( const TilePtr &tile, Batch &batch,
+      boost::unordered_map<Tile*, std::size_t> &batch_indices );
+
+  static void addMarker( Tile &tile, const SharedMarker &marker );
+  static void removeMarker( Tile &tile, const std::string &name );
+
+  ros::NodeHandle node_handle_;
+  std::string topic_ns_;
+  std::string server_id_;
+  double tile_size_;
+  ros::SubscriberStatusCallback init_connect_cb_;
+  double empty_tile_timeout_;
+
+  boost::unordered_map<TileIndex, TilePtr> tiles_;
+
+  // sequence numbers of the tiles that have been shut down, so that
+  // clients still subscribed to them can go on if they come back
+  boost::unordered_map<TileIndex, uint64_t> retired_seq_nums_;
+
+  // the tile each marker is in
+  boost::unordered_map<std::string, TilePtr> marker_tiles_;
+
+  // guards the tiles, as sending might happen from another thread than routing
+  boost::mutex mutex_;
+};
+
+}
+
+#endif /* TILE_PUBLISHER_H_ */
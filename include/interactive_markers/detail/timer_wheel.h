@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * timer_wheel.h
+ *
+ * Hierarchical timing wheel: schedules ids for expiry at integer ticks,
+ * with constant-time insertion and amortized constant-time expiry.
+ * Timers can't be cancelled, users are expected to ignore stale ids.
+ */
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <vector>
+#include <stdint.h>
+
+namespace interactive_markers
+{
+
+class TimerWheel
+{
+public:
+
+  // @param now  the current tick
+  explicit TimerWheel( uint64_t now = 0 );
+
+  // expire the id at the given tick. Ticks that have passed already
+  // expire on the next call to advance().
+  void schedule( uint64_t deadline, uint64_t id );
+
+  // move the current tick forward (never back) and append the ids of
+  // all timers that have expired up to and including it
+  void advance( uint64_t now, std::vector<uint64_t> &expired );
+
+  // drop all timers and start over at the given tick, which may also lie
+  // before the current one
+  void clear( uint64_t now );
+
+  uint64_t now() const { return now_; }
+
+  // number of scheduled timers
+  std::size_t size() const { return size_; }
+
+private:
+
+  struct Entry
+  {
+    uint64_t deadline;
+    uint64_t id;
+  };
+
+  // put an entry into the wheel of the first level that covers it
+  void place( const Entry &entry );
+
+  // re-place all entries of the given bucket relative to the current tick
+  void cascade( std::vector<Entry> &bucket );
+
+  static const unsigned int BITS_PER_LEVEL = 8;
+  static const unsigned int SLOTS_PER_LEVEL = 1 << BITS_PER_LEVEL;
+  static const unsigned int NUM_LEVELS = 4;
+
+  // Level k holds the entries whose deadline only differs from the current tick
+  // in the k-th group of bits (or below), in the slot given by that group.
+  std::vector<Entry> wheels_[NUM_LEVELS][SLOTS_PER_LEVEL];
+
+  // entries that are too far in the future for all levels
+  std::vector<Entry> overflow_;
+
+  uint64_t now_;
+  std::size_t size_;
+};
+
+}
+
+#endif /* TIMER_WHEEL_H_ */
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * transform_cache.h
+ *
+ * Remembers the results of tf lookups for one update cycle of a client,
+ * as most markers share their frame and time stamp. Lookups check whether
+ * the transform is available first, as letting tf throw an exception for
+ * each missing one is expensive when tf data arrives in bursts. Also lets tf tell
+ * when missing transforms arrive, so that messages waiting for them
+ * don't have to be retried all the time.
+ */
+
+#ifndef TRANSFORM_CACHE_H_
+#define TRANSFORM_CACHE_H_
+
+#include <tf2_ros/buffer.h>
+
+#include <geometry_msgs/TransformStamped.h>
+
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <string>
+#include <utility>
+
+namespace interactive_markers
+{
+
+class TransformCache
+{
+public:
+
+  explicit TransformCache( tf2_ros::Buffer &tf );
+
+  ~TransformCache();
+
+  // why a transform is not available, corresponding to the tf2 exceptions
+  enum ErrorType
+  {
+    NONE,
+    LOOKUP,
+    CONNECTIVITY,
+    EXTRAPOLATION,
+    INVALID_ARGUMENT,
+    TIMEOUT,
+    OTHER
+  };
+
+  // Same as tf.lookupTransform( target_frame, source_frame, time ), but each
+  // combination is only looked up once until the next call to clear(),
+  // and failures are returned instead of thrown.
+  // @param error  description of the failure, if any
+  ErrorType getTransform( const std::string &target_frame, const std::string &source_frame,
+      const ros::Time &time, geometry_msgs::TransformStamped &transform, std::string &error );
+
+  // Same as getTransform(), but throws an exception of the original type on failure.
+  geometry_msgs::TransformStamped lookupTransform( const std::string &target_frame,
+      const std::string &source_frame, const ros::Time &time );
+
+  // Latest time at which transforms between both frames are available,
+  // zero if there is none. Cached like the transforms.
+  ros::Time getLatestCommonTime( const std::string &target_frame, const std::string &source_frame );
+
+  // forget all results, so that new tf data is taken into account
+  void clear();
+
+  // Ask tf to notify us once the transform becomes available, or once it is
+  // clear that it never will. Requests for the same transform are merged.
+  // @return false if the transform might have arrived in the meantime,
+  //         so it is worth trying again right away
+  bool requestNotification( const std::string &target_frame,
+      const std::string &source_frame, const ros::Time &time );
+
+  // Number of notifications received so far. If it has not changed since a lookup
+  // failed and requestNotification() returned true, there is no point in trying again.
+  uint64_t getNumNotifications() const { return state_->num_notifications; }
+
+private:
+
+  struct Key
+  {
+    std::string target_frame;
+    std::string source_frame;
+    ros::Time time;
+    bool operator==( const Key &other ) const
+    {
+      return time == other.time && source_frame == other.source_frame && target_frame == other.target_frame;
+    }
+  };
+
+  struct KeyHash
+  {
+    std::size_t operator()( const Key &key ) const;
+  };
+
+  struct Result
+  {
+    ErrorType error_type;
+    std::string error;
+    geometry_msgs::TransformStamped transform;
+  };
+
+  // result of tf's getLatestCommonTime for a frame pair
+  struct CommonTime
+  {
+    int error_code;
+    ros::Time time;
+  };
+
+  typedef std::pair<std::string, std::string> FramePair;
+
+  // look up a transform, putting the error into the result
+  void lookup( const Key &key, Result &result );
+
+  CommonTime lookupCommonTime( const std::string &target_frame, const std::string &source_frame );
+
+  // throw the exception for the error
+  static void rethrow( ErrorType error_type, const std::string &error );
+
+  // everything the tf callback touches. tf might still run the callback
+  // while or after the cache is destroyed, so the callback keeps it alive.
+  struct State
+  {
+    State() : num_notifications(0) {}
+
+    boost::unordered_map<Key, Result, KeyHash> results;
+    boost::unordered_map<FramePair, CommonTime> common_times;
+
+    // requests that tf has not answered yet
+    boost::unordered_map<Key, tf2::TransformableRequestHandle, KeyHash> requests;
+    boost::unordered_map<tf2::TransformableRequestHandle, Key> request_keys;
+
+    boost::atomic<uint64_t> num_notifications;
+
+    // lookups can come from several threads
+    boost::mutex mutex;
+  };
+
+  typedef boost::shared_ptr<State> StatePtr;
+
+  // called by tf for our requests, possibly from another thread.
+  // Must not call tf, as it holds its own locks meanwhile.
+  static void transformableCb( const StatePtr &state, tf2::TransformableRequestHandle request_handle,
+      const std::string &target_frame, const std::string &source_frame, ros::Time time,
+      tf2::TransformableResult result );
+
+  tf2_ros::Buffer &tf_;
+
+  StatePtr state_;
+
+  tf2::TransformableCallbackHandle callback_handle_;
+};
+
+}
+
+#endif /* TRANSFORM_CACHE_H_ */
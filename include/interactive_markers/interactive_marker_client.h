@@ -38,6 +38,8 @@
 #include <boost/unordered_map.hpp>
 
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <ros/subscriber.h>
 #include <ros/node_handle.h>
@@ -48,7 +50,9 @@
 #include <visualization_msgs/InteractiveMarkerUpdate.h>
 #include <interactive_markers/visibility_control.hpp>
 
+#include "detail/keyed_thread_pool.h"
 #include "detail/state_machine.h"
+#include "detail/transform_cache.h"
 
 namespace interactive_markers
 {
@@ -62,6 +66,11 @@ class SingleClient;
 /// for each server. In case of an error (e.g. message loss, tf failure),
 /// the connection to the sending server is reset.
 ///
+/// Servers that send their poses on a topic of their own (see
+/// InteractiveMarkerServer::setSeparatePoseChannel()) are detected once that topic
+/// is advertised. Their updates may arrive out of order, so a missing one is only
+/// taken as lost after a second.
+///
 /// All timestamped messages are being transformed into the target frame,
 /// while for non-timestamped messages it is ensured that the necessary
 /// tf transformation will be available.
@@ -85,7 +94,8 @@ public:
 
   /// @param tf           The tf transformer to use.
   /// @param target_frame tf frame to transform timestamped messages into.
-  /// @param topic_ns     The topic namespace (will subscribe to topic_ns/update, topic_ns/init)
+  /// @param topic_ns     The topic namespace (will subscribe to topic_ns/update, topic_ns/init
+  ///                     and topic_ns/update_poses)
   INTERACTIVE_MARKERS_PUBLIC
   InteractiveMarkerClient(tf2_ros::Buffer &tf,
       const std::string& target_frame = "",
@@ -95,10 +105,21 @@ public:
   INTERACTIVE_MARKERS_PUBLIC
   ~InteractiveMarkerClient();
 
-  /// Subscribe to the topics topic_ns/update and topic_ns/init
+  /// Subscribe to the topics topic_ns/update and topic_ns/init, and to topic_ns/update_poses
+  /// for servers that send pose updates separately (see InteractiveMarkerServer::setSeparatePoseChannel())
   INTERACTIVE_MARKERS_PUBLIC
   void subscribe( std::string topic_ns );
 
+  /// Subscribe to some of the tiles of a server that publishes its markers in tiles
+  /// (see InteractiveMarkerServer::setTileSize()), i.e. to topic_ns/tiles/<name>/update
+  /// and update_full for each of them. Each tile is handled like a server of its own.
+  /// Changing the set of tiles while subscribed resets the connection.
+  /// The server shuts down tiles that have been empty for a while, so unlike with
+  /// subscribe( topic_ns ), a publisher going away is not taken as an error.
+  /// @param tiles  Indices of the tiles (see getTileIndex())
+  INTERACTIVE_MARKERS_PUBLIC
+  void subscribe( std::string topic_ns, const std::vector< std::pair<int, int> > &tiles );
+
   /// Unsubscribe, clear queues & call reset callbacks
   INTERACTIVE_MARKERS_PUBLIC
   void shutdown();
@@ -130,11 +151,20 @@ public:
   INTERACTIVE_MARKERS_PUBLIC
   void setEnableAutocompleteTransparency( bool enable ) { enable_autocomplete_transparency_ = enable;}
 
+  /// Transform the messages of different servers in parallel on a pool of worker
+  /// threads during update(). Callbacks are still called from update(), for one
+  /// server after another, in the same order as without workers.
+  /// Note: Do not call this from within a callback.
+  /// @param num_threads  Number of worker threads. Set to zero to transform in update() again.
+  INTERACTIVE_MARKERS_PUBLIC
+  void setNumTransformThreads( unsigned int num_threads );
+
 private:
 
   // Process message from the init or update channel
+  // @param pose_channel  true if the message came from the pose channel
   template<class MsgConstPtrT>
-  void process( const MsgConstPtrT& msg );
+  void process( const MsgConstPtrT& msg, bool pose_channel = false );
 
   ros::NodeHandle nh_;
 
@@ -147,10 +177,22 @@ private:
 
   StateMachine<StateT> state_;
 
-  std::string topic_ns_;
+  // the topics topic_ns/update & topic_ns/update_full of each of these are subscribed.
+  // Contains one entry, or one per tile.
+  std::vector<std::string> topic_namespaces_;
+
+  // true if topic_namespaces_ are tiles
+  bool subscribed_to_tiles_;
+
+  std::vector<ros::Subscriber> update_subs_;
+  std::vector<ros::Subscriber> pose_subs_;
+  std::vector<ros::Subscriber> init_subs_;
 
-  ros::Subscriber update_sub_;
-  ros::Subscriber init_sub_;
+  // pose topics (see InteractiveMarkerServer::setSeparatePoseChannel) that nobody
+  // has advertised yet, and when we last asked the master about them.
+  // Tiles don't have any.
+  std::vector<std::string> pose_topics_;
+  ros::WallTime last_pose_topic_check_;
 
   // subscribe to the init channel
   void subscribeInit();
@@ -158,6 +200,15 @@ private:
   // subscribe to the init channel
   void subscribeUpdate();
 
+  // subscribe to the pose topics that have been advertised by now
+  void subscribePoseUpdates();
+
+  // total number of publishers on the update channels
+  uint32_t getNumUpdatePublishers() const;
+
+  // true if any server sends pose updates on a channel of their own
+  bool hasPosePublishers() const;
+
   void statusCb( StatusT status, const std::string& server_id, const std::string& msg );
 
   typedef boost::shared_ptr<SingleClient> SingleClientPtr;
@@ -168,6 +219,12 @@ private:
   tf2_ros::Buffer& tf_;
   std::string target_frame_;
 
+  // tf lookups of all servers, cleared on every update()
+  TransformCache transform_cache_;
+
+  // see setNumTransformThreads. Only used while publisher_contexts_mutex_ is held.
+  boost::shared_ptr<KeyedThreadPool> transform_pool_;
+
 public:
   // for internal usage
   struct CbCollection
@@ -207,6 +264,9 @@ public:
   // handle update message
   void processUpdate( const UpdateConstPtr& msg );
 
+  // handle update message from the pose channel
+  void processPoseUpdate( const UpdateConstPtr& msg );
+
 private:
   CbCollection callbacks_;
 
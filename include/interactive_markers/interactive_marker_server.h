@@ -33,12 +33,21 @@
 #define INTERACTIVE_MARKER_SERVER
 
 #include <visualization_msgs/InteractiveMarkerUpdate.h>
+#include <visualization_msgs/InteractiveMarkerInit.h>
 #include <visualization_msgs/InteractiveMarkerFeedback.h>
 #include <interactive_markers/visibility_control.hpp>
-
-#include <boost/scoped_ptr.hpp>
+#include <interactive_markers/detail/shared_marker.h>
+#include <interactive_markers/detail/keyed_thread_pool.h>
+#include <interactive_markers/detail/mpsc_queue.h>
+#include <interactive_markers/detail/timer_wheel.h>
+#include <interactive_markers/detail/spatial_grid.h>
+#include <interactive_markers/detail/tile_publisher.h>
+
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread/thread.hpp>
-#include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 #include <ros/ros.h>
 #include <ros/callback_queue.h>
@@ -54,6 +63,11 @@ namespace interactive_markers
 ///
 /// Note: Keep in mind that changes made by calling insert(), erase(), setCallback() etc.
 ///       are not applied until calling applyChanges().
+///
+/// All methods are thread-safe. Reading methods (get(), size() etc.) and pose updates
+/// of existing markers can run concurrently; everything else is serialized.
+/// Feedback callbacks are called without holding the server lock, so they can
+/// use the server freely.
 class InteractiveMarkerServer : boost::noncopyable
 {
 public:
@@ -61,7 +75,14 @@ public:
   typedef visualization_msgs::InteractiveMarkerFeedbackConstPtr FeedbackConstPtr;
   typedef boost::function< void ( const FeedbackConstPtr& ) > FeedbackCallback;
 
+  /// Identifies a marker without the need to look up its name.
+  /// A handle stays valid until the erasure of its marker has been applied.
+  typedef uint64_t MarkerHandle;
+
+  typedef KeyedThreadPoolStats FeedbackExecutorStats;
+
   static const uint8_t DEFAULT_FEEDBACK_CB = 255;
+  static const MarkerHandle INVALID_HANDLE = 0;
 
   /// @param topic_ns      The interface will use the topics topic_ns/update and
   ///                      topic_ns/feedback for communication.
@@ -70,8 +91,12 @@ public:
   ///                      Otherwise, leave this empty.
   /// @param spin_thread   If set to true, will spin up a thread for message handling.
   ///                      All callbacks will be called from that thread.
+  /// @param num_spin_threads  Number of threads to spin up if spin_thread is set.
+  ///                      Note: With more than one thread, feedback for the same marker
+  ///                      may be processed out of order, unless a feedback executor is set.
   INTERACTIVE_MARKERS_PUBLIC
-  InteractiveMarkerServer( const std::string &topic_ns, const std::string &server_id="", bool spin_thread = false );
+  InteractiveMarkerServer( const std::string &topic_ns, const std::string &server_id="", bool spin_thread = false,
+      unsigned int num_spin_threads = 1 );
 
   /// Destruction of the interface will lead to all managed markers being cleared.
   INTERACTIVE_MARKERS_PUBLIC
@@ -81,8 +106,9 @@ public:
   /// Note: Changes to the marker will not take effect until you call applyChanges().
   /// The callback changes immediately.
   /// @param int_marker     The marker to be added or replaced
+  /// @return A handle that can be used instead of the marker name
   INTERACTIVE_MARKERS_PUBLIC
-  void insert( const visualization_msgs::InteractiveMarker &int_marker );
+  MarkerHandle insert( const visualization_msgs::InteractiveMarker &int_marker );
 
   /// Add or replace a marker and its callback functions
   /// Note: Changes to the marker will not take effect until you call applyChanges().
@@ -90,11 +116,52 @@ public:
   /// @param int_marker     The marker to be added or replaced
   /// @param feedback_cb    Function to call on the arrival of a feedback message.
   /// @param feedback_type  Type of feedback for which to call the feedback.
+  /// @return A handle that can be used instead of the marker name
   INTERACTIVE_MARKERS_PUBLIC
-  void insert( const visualization_msgs::InteractiveMarker &int_marker,
+  MarkerHandle insert( const visualization_msgs::InteractiveMarker &int_marker,
                FeedbackCallback feedback_cb,
                uint8_t feedback_type=DEFAULT_FEEDBACK_CB );
 
+  /// Add or replace a marker without changing its callback functions,
+  /// taking over its contents instead of copying them.
+  /// Note: Changes to the marker will not take effect until you call applyChanges().
+  /// @param int_marker     The marker to be added or replaced
+  /// @return A handle that can be used instead of the marker name
+  INTERACTIVE_MARKERS_PUBLIC
+  MarkerHandle insert( visualization_msgs::InteractiveMarker &&int_marker );
+
+  /// Add or replace a marker and its callback functions,
+  /// taking over its contents instead of copying them.
+  /// Note: Changes to the marker will not take effect until you call applyChanges().
+  /// @param int_marker     The marker to be added or replaced
+  /// @param feedback_cb    Function to call on the arrival of a feedback message.
+  /// @param feedback_type  Type of feedback for which to call the feedback.
+  /// @return A handle that can be used instead of the marker name
+  INTERACTIVE_MARKERS_PUBLIC
+  MarkerHandle insert( visualization_msgs::InteractiveMarker &&int_marker,
+               FeedbackCallback feedback_cb,
+               uint8_t feedback_type=DEFAULT_FEEDBACK_CB );
+
+  /// Add or replace a marker that is erased automatically after the given time,
+  /// unless it is inserted again before. Other changes don't extend the lifetime.
+  /// Expired markers are erased as if erase() had been called, so the clients
+  /// are told with the next applyChanges(). Inserting a marker without lifetime
+  /// makes it permanent again.
+  /// The server looks for expired markers in applyChanges() and with each keep-alive,
+  /// so a marker can outlive its lifetime by up to 0.5 s if applyChanges() isn't called.
+  /// Note: Changes to the marker will not take effect until you call applyChanges().
+  /// @param int_marker  The marker to be added or replaced
+  /// @param lifetime    Time after which the marker is erased, in ROS time.
+  ///                    Zero or less means it never expires.
+  /// @return A handle that can be used instead of the marker name
+  INTERACTIVE_MARKERS_PUBLIC
+  MarkerHandle insert( const visualization_msgs::InteractiveMarker &int_marker, const ros::Duration &lifetime );
+
+  /// Add or replace a marker that is erased automatically after the given time,
+  /// taking over its contents instead of copying them. See above.
+  INTERACTIVE_MARKERS_PUBLIC
+  MarkerHandle insert( visualization_msgs::InteractiveMarker &&int_marker, const ros::Duration &lifetime );
+
   /// Update the pose of a marker with the specified name
   /// Note: This change will not take effect until you call applyChanges()
   /// @return true if a marker with that name exists
@@ -106,6 +173,33 @@ public:
       const geometry_msgs::Pose &pose,
       const std_msgs::Header &header=std_msgs::Header() );
 
+  /// Update the pose of the marker with the specified handle
+  /// Note: This change will not take effect until you call applyChanges()
+  /// @return true if the handle is valid
+  INTERACTIVE_MARKERS_PUBLIC
+  bool setPose( MarkerHandle handle,
+      const geometry_msgs::Pose &pose,
+      const std_msgs::Header &header=std_msgs::Header() );
+
+  /// Update the poses of many markers at once, sharing one header.
+  /// This is equivalent to, but much cheaper than calling setPose() for each marker.
+  /// Note: This change will not take effect until you call applyChanges()
+  /// @return The number of markers that exist and have been updated
+  /// @param names   Names of the interactive markers
+  /// @param poses   The new poses, one for each name
+  /// @param header  Header replacement. Leave this empty to use the previous ones.
+  INTERACTIVE_MARKERS_PUBLIC
+  std::size_t setPoses( const std::vector<std::string> &names,
+      const std::vector<geometry_msgs::Pose> &poses,
+      const std_msgs::Header &header=std_msgs::Header() );
+
+  /// Update the poses of many markers at once, sharing one header.
+  /// @return The number of handles that are valid
+  INTERACTIVE_MARKERS_PUBLIC
+  std::size_t setPoses( const std::vector<MarkerHandle> &handles,
+      const std::vector<geometry_msgs::Pose> &poses,
+      const std_msgs::Header &header=std_msgs::Header() );
+
   /// Erase the marker with the specified name
   /// Note: This change will not take effect until you call applyChanges().
   /// @return true if a marker with that name exists
@@ -113,10 +207,30 @@ public:
   INTERACTIVE_MARKERS_PUBLIC
   bool erase( const std::string &name );
 
+  /// Erase the marker with the specified handle
+  /// Note: This change will not take effect until you call applyChanges().
+  /// @return true if the handle is valid
+  INTERACTIVE_MARKERS_PUBLIC
+  bool erase( MarkerHandle handle );
+
   /// Clear all markers.
   /// Note: This change will not take effect until you call applyChanges().
+  /// Takes constant time for the markers that have already been applied.
   INTERACTIVE_MARKERS_PUBLIC
   void clear();
+
+  /// Erase all markers whose name matches the predicate.
+  /// Note: This change will not take effect until you call applyChanges().
+  /// The predicate is called with the server lock held, so it must not use the server.
+  /// @return The number of markers that have been erased
+  INTERACTIVE_MARKERS_PUBLIC
+  std::size_t eraseIf( const boost::function< bool ( const std::string& ) > &predicate );
+
+  /// Erase all markers whose name starts with the given prefix, e.g. a namespace.
+  /// Note: This change will not take effect until you call applyChanges().
+  /// @return The number of markers that have been erased
+  INTERACTIVE_MARKERS_PUBLIC
+  std::size_t erasePrefix( const std::string &prefix );
   
   /// Return whether the server contains any markers.
   /// Note: Does not include markers inserted since the last applyChanges().
@@ -144,6 +258,17 @@ public:
   bool setCallback( const std::string &name, FeedbackCallback feedback_cb,
       uint8_t feedback_type=DEFAULT_FEEDBACK_CB );
 
+  /// Add or replace a callback function for the marker with the specified handle.
+  /// @return true if the handle is valid
+  INTERACTIVE_MARKERS_PUBLIC
+  bool setCallback( MarkerHandle handle, FeedbackCallback feedback_cb,
+      uint8_t feedback_type=DEFAULT_FEEDBACK_CB );
+
+  /// Get the handle of an existing or pending marker
+  /// @return INVALID_HANDLE if there is no marker with that name
+  INTERACTIVE_MARKERS_PUBLIC
+  MarkerHandle getHandle( const std::string &name ) const;
+
   /// Apply changes made since the last call to this method &
   /// broadcast an update to all clients.
   INTERACTIVE_MARKERS_PUBLIC
@@ -154,7 +279,170 @@ public:
   /// @param[out] int_marker  Output message
   /// @return true if a marker with that name exists
   INTERACTIVE_MARKERS_PUBLIC
-  bool get( std::string name, visualization_msgs::InteractiveMarker &int_marker ) const;
+  bool get( const std::string &name, visualization_msgs::InteractiveMarker &int_marker ) const;
+
+  /// Get marker by name without copying it.
+  /// The returned marker is shared with the server and must not be modified.
+  /// A copy is only made if its pose or header has changed since it was inserted.
+  /// @param name  Name of the interactive marker
+  /// @return The marker, or an empty pointer if there is no marker with that name
+  INTERACTIVE_MARKERS_PUBLIC
+  visualization_msgs::InteractiveMarkerConstPtr getShared( const std::string &name ) const;
+
+  /// Only publish the complete state on the init topic when it is actually needed.
+  /// By default, it is re-published on every call to applyChanges(). When enabled,
+  /// it is published when a new client subscribes (and on every applyChanges() for a short
+  /// while after that, until the client is in sync), and otherwise at most at the given rate.
+  /// @param enable    Turn lazy publishing on or off.
+  /// @param max_rate  Maximum rate (in Hz) at which a changed state is re-published
+  ///                  while no new client subscribes. Set to zero to only publish on new subscriptions.
+  INTERACTIVE_MARKERS_PUBLIC
+  void setLazyInitPublishing( bool enable, double max_rate = 1.0 );
+
+  /// Don't send markers to the clients again if they are re-inserted without changes.
+  /// When enabled, the server keeps a hash of the contents of each marker. If a marker is
+  /// replaced by one with identical contents, applyChanges() leaves it out of the update,
+  /// or only sends its pose if pose or header have changed.
+  /// This costs one serialization of the marker per call to insert(), and two more
+  /// when applyChanges() finds a matching hash, to compare the actual contents.
+  INTERACTIVE_MARKERS_PUBLIC
+  void setSuppressRedundantUpdates( bool enable );
+
+  /// Limit the size of the update messages sent by applyChanges().
+  /// Larger change sets are split into several consecutive updates, each with its own
+  /// sequence number, so clients can start processing before everything has arrived.
+  /// Single markers larger than the limit are still sent, in a message of their own.
+  /// @param max_bytes  Maximum serialized size of an update. Zero means unlimited (the default).
+  INTERACTIVE_MARKERS_PUBLIC
+  void setMaxUpdateSize( uint32_t max_bytes );
+
+  /// Limit the bandwidth used for sending new and changed markers to the clients.
+  /// Erases and pose updates are always sent right away. Full marker updates that don't fit
+  /// into the budget are kept back and sent with later updates, the markers the user
+  /// has interacted with most recently first. Until then, clients see the previous version
+  /// of a marker (moved to its new pose), or nothing for new markers.
+  /// get() still returns the state given to the server.
+  /// @param bytes_per_second  Average budget. At most one second worth of it can be saved up.
+  ///                          Zero or less means unlimited (the default).
+  INTERACTIVE_MARKERS_PUBLIC
+  void setMaxBandwidth( double bytes_per_second );
+
+  /// Call feedback callbacks from a pool of worker threads instead of the thread
+  /// that receives the feedback, and without holding the server lock.
+  /// This way, a slow callback does not block other markers or calls to the server.
+  /// Callbacks for the same marker are still called one after another, in order.
+  /// Note: with an executor, callbacks for different markers can run concurrently.
+  ///       Do not call this from within a feedback callback.
+  /// @param num_threads  Number of worker threads. Set to zero to call the callbacks directly again,
+  ///                     which also turns setCoalescePoseUpdates() off.
+  /// @param max_queued   Number of callbacks waiting for a worker at which the processing
+  ///                     of new feedback blocks until a callback has finished. Zero means unlimited.
+  INTERACTIVE_MARKERS_PUBLIC
+  void setFeedbackExecutor( unsigned int num_threads, std::size_t max_queued = 1000 );
+
+  /// Only call the feedback callback for the newest of the POSE_UPDATE feedback messages
+  /// for a marker that are waiting in the feedback executor. All other event types
+  /// (e.g. MOUSE_DOWN, MOUSE_UP, MENU_SELECT) are still delivered, in order. This keeps
+  /// dragged markers responsive when the callback is slower than the feedback rate.
+  /// Note: This needs a feedback executor. If none is set, a single-threaded one is created,
+  ///       which blocks new feedback once 1000 callbacks are waiting (see setFeedbackExecutor()).
+  ///       Removing the executor with setFeedbackExecutor( 0 ) turns coalescing off again.
+  INTERACTIVE_MARKERS_PUBLIC
+  void setCoalescePoseUpdates( bool enable );
+
+  /// Get statistics about the callbacks run by the feedback executor, if there is one.
+  INTERACTIVE_MARKERS_PUBLIC
+  FeedbackExecutorStats getFeedbackExecutorStats() const;
+
+  /// Let setPose(), setPoses() and erase() put their changes into a lock-free queue
+  /// instead of acquiring the server lock, so callers never wait for each other or
+  /// for applyChanges(). The queue is drained (the latest change per marker wins)
+  /// by applyChanges() and before any other change to the server.
+  /// Note: In this mode, these methods can't check if the marker exists. They always
+  ///       return true (setPoses() the number of poses), unknown markers are ignored later.
+  ///       get() does not see queued changes until they have been drained.
+  /// @param enable  Turn queueing on or off. Turning it off drains the queue.
+  INTERACTIVE_MARKERS_PUBLIC
+  void setLockFreeUpdates( bool enable );
+
+  /// Send messages to the clients from a background thread.
+  /// applyChanges() then only commits the changes (so get() etc. reflect them right away)
+  /// and hands the resulting update to that thread, which serializes and publishes it.
+  /// Keep-alive and init messages go through the same thread, so everything is still
+  /// sent in order.
+  /// @param enable  Turn background publishing on or off. Turning it off waits until
+  ///                everything queued so far has been sent.
+  INTERACTIVE_MARKERS_PUBLIC
+  void setAsyncPublishing( bool enable );
+
+  /// Send pose updates on the topic topic_ns/update_poses instead of topic_ns/update, so
+  /// that bursts of new or changed markers don't delay them or push them out of the queues.
+  /// Both topics share one sequence of update numbers, so clients (see InteractiveMarkerClient)
+  /// merge them back into the original order.
+  /// This is off by default, as it is incompatible with clients built before the pose topic
+  /// existed: they don't subscribe to it, so they see gaps in the sequence numbers and keep
+  /// resetting their connection. Only turn it on if all clients know about the pose topic.
+  /// Note: Tiles (see setTileSize()) keep sending poses with the other changes.
+  /// @param enable  Turn the separate pose channel on or off.
+  INTERACTIVE_MARKERS_PUBLIC
+  void setSeparatePoseChannel( bool enable );
+
+  /// Block until all messages handed to the background publisher have been sent.
+  /// Returns right away if async publishing is off.
+  INTERACTIVE_MARKERS_PUBLIC
+  void waitForPublishing();
+
+  /// Keep the marker positions in a uniform grid, so that queryBox(), queryRadius()
+  /// and eraseInBox() only look at the markers near the queried region.
+  /// Without it, they go through all markers. Note: While the index is enabled,
+  /// setPose() needs the exclusive server lock.
+  /// @param cell_size  Edge length of the grid cells, ideally in the order of the size
+  ///                   of typical queries. Zero or less disables the index.
+  INTERACTIVE_MARKERS_PUBLIC
+  void setSpatialIndex( double cell_size );
+
+  /// Find the markers whose position is inside the given axis-aligned box (inclusive).
+  /// Includes changes that have not been applied yet, like get().
+  /// @param frame_id    Only markers whose header has this frame are considered.
+  /// @param[out] names  The names of the markers found are appended to this.
+  /// @return The number of markers found
+  INTERACTIVE_MARKERS_PUBLIC
+  std::size_t queryBox( const std::string &frame_id, const geometry_msgs::Point &min,
+      const geometry_msgs::Point &max, std::vector<std::string> &names ) const;
+
+  /// Find the markers whose position is within the given distance of a point.
+  /// See queryBox().
+  INTERACTIVE_MARKERS_PUBLIC
+  std::size_t queryRadius( const std::string &frame_id, const geometry_msgs::Point &center,
+      double radius, std::vector<std::string> &names ) const;
+
+  /// Erase all markers whose position is inside the given box. See queryBox().
+  /// Note: This change will not take effect until you call applyChanges().
+  /// @return The number of markers that have been erased
+  INTERACTIVE_MARKERS_PUBLIC
+  std::size_t eraseInBox( const std::string &frame_id, const geometry_msgs::Point &min,
+      const geometry_msgs::Point &max );
+
+  /// Additionally publish the markers split into square tiles of the x-y plane, so that
+  /// clients only interested in one area can subscribe to the tiles covering it
+  /// (see InteractiveMarkerClient::subscribe()). Each tile is published on the topics
+  /// topic_ns/tiles/<name>/update and update_full (see makeTileName()) as if it were
+  /// a server of its own, with the server id <server_id>/<name>.
+  /// A marker belongs to the tile containing its position in its own frame, so this is
+  /// meant for servers whose markers share one frame. Markers moving to another tile
+  /// are erased from the old one and sent in full on the new one.
+  /// topic_ns/update and update_full keep carrying all markers.
+  /// The init messages of the tiles are published along with the one of the server,
+  /// so they follow setLazyInitPublishing() as well.
+  /// Tiles are advertised when the first marker enters them. Once a tile has been empty
+  /// for empty_tile_timeout, it gets an empty init message and its topics are shut down.
+  /// Its sequence numbers continue if a marker enters it again.
+  /// Note: Tile updates are not split (see setMaxUpdateSize()).
+  /// @param tile_size  Edge length of the tiles. Zero or less turns tiling off.
+  /// @param empty_tile_timeout  Time (in seconds, wall time) after which empty tiles are shut down.
+  ///                   This is checked with each keep-alive, i.e. every 0.5 s.
+  INTERACTIVE_MARKERS_PUBLIC
+  void setTileSize( double tile_size, double empty_tile_timeout = 10.0 );
 
 private:
 
@@ -164,11 +452,12 @@ private:
     std::string last_client_id;
     FeedbackCallback default_feedback_cb;
     boost::unordered_map<uint8_t,FeedbackCallback> feedback_cbs;
-    visualization_msgs::InteractiveMarker int_marker;
+    // position of the committed marker in init_msg_.markers
+    std::size_t init_index;
+    // see hashMarkerContents(), zero if unknown
+    uint64_t content_hash;
   };
 
-  typedef boost::unordered_map< std::string, MarkerContext > M_MarkerContext;
-
   // represents an update to a single marker
   struct UpdateContext
   {
@@ -177,16 +466,84 @@ private:
       POSE_UPDATE,
       ERASE
     } update_type;
-    visualization_msgs::InteractiveMarker int_marker;
+    // the new marker for FULL_UPDATE (int_marker is unset otherwise)
+    // and the new header & pose for FULL_UPDATE and POSE_UPDATE
+    SharedMarker marker;
+    // hash of marker.int_marker for FULL_UPDATE, zero if unknown
+    uint64_t content_hash;
     FeedbackCallback default_feedback_cb;
     boost::unordered_map<uint8_t,FeedbackCallback> feedback_cbs;
   };
 
-  typedef boost::unordered_map< std::string, UpdateContext > M_UpdateContext;
+  // all state belonging to one marker name
+  struct MarkerSlot
+  {
+    std::string name;
+    // incremented whenever the slot is released, which invalidates old handles
+    uint32_t version;
+    bool in_use;
+    // marker_context is valid
+    bool committed;
+    MarkerContext marker_context;
+    // update_context is valid and the slot is listed in dirty_slots_,
+    // or in deferred_slots_ if deferred is set
+    bool pending;
+    // the update has been applied, but is waiting for bandwidth
+    bool deferred;
+    UpdateContext update_context;
+    // position in staged_poses_, or NO_SLOT
+    uint32_t staged_index;
+    // tick of expiry_wheel_ at which the marker is erased, zero for never
+    uint64_t expiry_tick;
+  };
+
+  static const uint32_t NO_SLOT = 0xffffffff;
+
+  // pose updates of committed markers, kept as a structure of arrays
+  // so that they can be written straight into the next update message
+  struct PoseStaging
+  {
+    std::vector<uint32_t> slots;
+    std::vector<geometry_msgs::Pose> poses;
+    // index into headers for each pose, or NO_SLOT to keep the current header
+    std::vector<uint32_t> header_indices;
+    std::vector<std_msgs::Header> headers;
+
+    // guards the above while mutex_ is only held shared
+    boost::mutex mutex;
+
+    bool empty() const { return slots.empty(); }
+    void clear();
+
+    // add a header, return its index (NO_SLOT if it is empty)
+    uint32_t addHeader( const std_msgs::Header &header );
+  };
+
+  // Pose updates are staged into one of several shards (chosen by slot index)
+  // while only holding mutex_ shared, so that threads updating different
+  // markers rarely wait for each other.
+  static const std::size_t NUM_POSE_SHARDS = 16;
+
+  // a change made through the lock-free queue, see setLockFreeUpdates()
+  struct QueuedUpdate
+  {
+    enum {
+      POSE_UPDATE,
+      ERASE
+    } update_type;
+    // the marker is addressed by handle if set, otherwise by name
+    MarkerHandle handle;
+    std::string name;
+    geometry_msgs::Pose pose;
+    std_msgs::Header header;
+  };
+
+  typedef boost::shared_lock<boost::shared_mutex> ReadLock;
+  typedef boost::unique_lock<boost::shared_mutex> WriteLock;
 
-  // main loop when spinning our own thread
-  // - process callbacks in our callback queue
-  // - process pending goals
+  // main loop when spinning our own threads
+  // - process callbacks in our callback queue as soon as they arrive
+  // - return as soon as the queue is disabled on shutdown
   void spinThread();
 
   // update marker pose & call user callback
@@ -195,40 +552,249 @@ private:
   // send an empty update to keep the client GUIs happy
   void keepAlive();
 
-  // increase sequence number & publish an update
-  void publish( visualization_msgs::InteractiveMarkerUpdate &update );
+  // commit pending updates and send them to the clients.
+  // @param apply_changes  false to only send deferred updates
+  void flush( bool apply_changes );
+
+  // commit as many of the given pending full updates as the bandwidth budget
+  // allows, defer the rest
+  void commitFullUpdates( std::vector<uint32_t> &slot_indices, SharedMarkerUpdate &update );
+  static bool compareFeedbackTime( const std::pair<ros::Time, uint32_t> &a, const std::pair<ros::Time, uint32_t> &b );
+
+  // write the pending update of a slot into the committed state & the given update
+  void commitSlot( uint32_t slot_index, SharedMarkerUpdate &update );
+
+  // change the pose of a committed marker & add it to the given update
+  void commitPose( uint32_t slot_index, const std_msgs::Header &header,
+      const geometry_msgs::Pose &pose, SharedMarkerUpdate &update );
+
+  // hand an update to the clients, either directly or through the background
+  // publisher (see setAsyncPublishing). The given update may be modified.
+  void publishUpdate( SharedMarkerUpdate &update );
 
-  // publish the current complete state to the latched "init" topic.
+  // hand the tile messages resulting from an update to the clients, see setTileSize
+  void publishTiles( const boost::shared_ptr<TilePublisher::Batch> &batch );
+
+  // publish the state of the tiles that have changed, without locking
+  void publishTileInits();
+
+  // publish the current complete state to the latched "init" topic, without locking
   void publishInit();
 
+  // The following actually send messages. They are called by the background
+  // publisher if there is one, otherwise with the lock held.
+  // Only they access seq_num_.
+
+  // publish an update, moving the poses to the pose channel if there is one
+  void sendUpdate( SharedMarkerUpdate &update, uint32_t max_update_size );
+  void sendUpdateJob( const boost::shared_ptr<SharedMarkerUpdate> &update, uint32_t max_update_size );
+
+  // increase sequence number & publish an update on the given channel, split into
+  // several consecutive ones if it is larger than max_update_size
+  void sendUpdate( SharedMarkerUpdate &update, uint32_t max_update_size, ros::Publisher &publisher );
+
+  // increase sequence number, publish & empty a part of a split update
+  void sendChunk( SharedMarkerUpdate &chunk, ros::Publisher &publisher );
+
+  // publish an update with the current sequence number
+  void send( SharedMarkerUpdate &update, ros::Publisher &publisher );
+
+  void sendKeepAlive();
+
+  void sendInit( SharedMarkerInit &init );
+  void sendInitJob( const boost::shared_ptr<SharedMarkerInit> &init );
+
+  // publish the init message if it is out of date and we are allowed to, without locking
+  void publishInitIfDue();
+
+  // called when a client subscribes to the init topic
+  void initSubscriberConnected( const ros::SingleSubscriberPublisher& pub );
+
+  // committed state of the given marker, stored in init_msg_
+  SharedMarker& committedMarker( const MarkerSlot& slot );
+  const SharedMarker& committedMarker( const MarkerSlot& slot ) const;
+
+  // remove a committed marker from init_msg_, keeping the indices of
+  // the remaining marker contexts valid
+  void eraseCommitted( uint32_t slot_index );
+
+  // true if the slot holds a committed marker that has not been cleared since
+  bool isLive( const MarkerSlot &slot ) const { return slot.committed && !clear_pending_; }
+
+  // true if the marker exists, including pending changes
+  bool isPresent( const MarkerSlot &slot ) const;
+
+  // erase all committed markers after clear(), except for the ones that have
+  // pending updates, and add them to the given update
+  void eraseCleared( SharedMarkerUpdate &update );
+
+  // current state of a marker, including pending changes.
+  // @return false if the marker does not exist (anymore)
+  bool getCurrent( uint32_t slot_index, SharedMarker &marker ) const;
+
+  // schedule a full update of the marker without locking
+  MarkerHandle doInsert( const visualization_msgs::InteractiveMarkerConstPtr &int_marker );
+
+  // let the marker in the given slot expire after lifetime
+  void setLifetime( uint32_t slot_index, const ros::Duration &lifetime );
+
+  // bring the entry of the slot in spatial_index_ in line with its current state
+  void updateSpatialIndex( uint32_t slot_index );
+
+  // slots of the markers in the box / sphere, using spatial_index_ if there is one
+  void findInBox( const std::string &frame_id, const geometry_msgs::Point &min,
+      const geometry_msgs::Point &max, std::vector<uint32_t> &slot_indices ) const;
+  void findInRadius( const std::string &frame_id, const geometry_msgs::Point &center,
+      double radius, std::vector<uint32_t> &slot_indices ) const;
+
+  // advance expiry_wheel_ to the current time & erase the expired markers
+  void expireMarkers();
+
+  // the current time in ticks of expiry_wheel_. If time has gone backwards,
+  // the pending lifetimes are rescheduled relative to it.
+  uint64_t getExpiryTick();
+
+  // slot management without locking
+  uint32_t findSlot( const std::string &name ) const;
+  uint32_t findSlot( MarkerHandle handle ) const;
+  uint32_t acquireSlot( const std::string &name );
+  void releaseSlotIfUnused( uint32_t slot_index );
+  MarkerHandle makeHandle( uint32_t slot_index ) const;
+
+  // return the pending update of the slot, creating an empty one if necessary
+  UpdateContext& pendingUpdate( uint32_t slot_index );
+
+  // setPose() and setPoses() for names or handles. Pose updates of committed markers
+  // are staged under a shared lock, everything else takes the exclusive one.
+  template<class Key> bool lockAndSetPose( const Key &key,
+      const geometry_msgs::Pose &pose, const std_msgs::Header &header );
+  template<class Key> std::size_t lockAndSetPoses( const std::vector<Key> &keys,
+      const std::vector<geometry_msgs::Pose> &poses, const std_msgs::Header &header );
+
+  // address the marker of a queued update
+  static void setQueuedMarker( QueuedUpdate &update, const std::string &name );
+  static void setQueuedMarker( QueuedUpdate &update, MarkerHandle handle );
+
+  // apply the changes in update_queue_, needs the exclusive lock
+  void drainUpdateQueue();
+
+  // implementations of the public interface without locking
+  bool doSetPose( uint32_t slot_index, const geometry_msgs::Pose &pose, const std_msgs::Header &header );
+  bool doErase( uint32_t slot_index );
+  bool doSetCallback( uint32_t slot_index, FeedbackCallback feedback_cb, uint8_t feedback_type );
+
   // Update pose, schedule update without locking
-  void doSetPose( M_UpdateContext::iterator update_it,
-      const std::string &name,
+  void schedulePoseUpdate( uint32_t slot_index,
       const geometry_msgs::Pose &pose,
       const std_msgs::Header &header );
 
-  // contains the current state of all markers
-  M_MarkerContext marker_contexts_;
+  // If the slot holds a committed marker without pending update, put the pose update
+  // into its shard of staged_poses_. Needs at least a shared lock.
+  // @param header  Header replacement. Leave this empty to keep the current one.
+  // @return false if the update has to be scheduled with the exclusive lock held
+  bool stagePose( uint32_t slot_index, const geometry_msgs::Pose &pose, const std_msgs::Header &header );
+
+  PoseStaging& poseShard( uint32_t slot_index ) const { return staged_poses_[slot_index % NUM_POSE_SHARDS]; }
+
+  // write all staged pose updates into the committed state & the given update
+  void flushStagedPoses( SharedMarkerUpdate &update );
+  bool hasStagedPoses() const;
+  std::size_t numStagedPoses() const;
+
+  // the state of all existing or pending markers, addressed by handles
+  std::vector<MarkerSlot> slots_;
+  std::vector<uint32_t> free_slots_;
+  boost::unordered_map<std::string, uint32_t> slot_index_;
+
+  // slots with pending updates that have to be sent on the next publish
+  std::vector<uint32_t> dirty_slots_;
+
+  // clear() has been called since the last applyChanges(), so all committed
+  // markers without pending update have to be erased
+  bool clear_pending_;
+
+  // slots with applied full updates that are waiting for bandwidth
+  std::vector<uint32_t> deferred_slots_;
+
+  // pose updates that have to be sent on the next publish, see poseShard()
+  mutable PoseStaging staged_poses_[NUM_POSE_SHARDS];
+
+  // for each entry in init_msg_.markers, the slot it belongs to
+  std::vector<uint32_t> init_slots_;
+
+  // complete state of all markers, patched in place by applyChanges()
+  // so that publishing it does not require rebuilding it from scratch.
+  // The marker contents are shared with pending updates and outgoing messages.
+  SharedMarkerInit init_msg_;
+
+  // true if init_msg_ has changed since it was last published
+  bool init_dirty_;
+
+  // if set, init_msg_ is only published on demand (see setLazyInitPublishing)
+  bool lazy_init_;
+  ros::WallDuration min_init_period_;
+  ros::WallTime last_init_publish_;
+
+  // keep publishing init_msg_ on changes until then, as a newly connected
+  // client needs an init message that is in line with the updates it receives
+  ros::WallTime init_demand_until_;
+
+  // see setMaxUpdateSize
+  uint32_t max_update_size_;
+
+  // see setMaxBandwidth. bandwidth_tokens_ is the number of bytes
+  // we can send right now, it can become negative.
+  double max_bandwidth_;
+  double bandwidth_tokens_;
+  ros::WallTime last_bandwidth_refill_;
+
+  // see setSuppressRedundantUpdates
+  bool suppress_redundant_updates_;
+  std::vector<uint8_t> hash_buffer_;
+
+  // expires markers inserted with a lifetime, see expireMarkers()
+  TimerWheel expiry_wheel_;
+  std::vector<uint64_t> expired_handles_;
+
+  // current marker positions by slot index if set, see setSpatialIndex
+  boost::shared_ptr<SpatialGrid> spatial_index_;
+
+  // publishes the markers in tiles if set, see setTileSize
+  boost::shared_ptr<TilePublisher> tile_publisher_;
+
+  // see setLockFreeUpdates
+  MpscQueue<QueuedUpdate> update_queue_;
+  boost::atomic<bool> lock_free_updates_;
+
+  // sends all messages if set (see setAsyncPublishing). A thread pool
+  // with a single thread, which only ever gets tasks with the same key.
+  boost::shared_ptr<KeyedThreadPool> publisher_;
 
-  // updates that have to be sent on the next publish
-  M_UpdateContext pending_updates_;
+  // runs feedback callbacks if set (see setFeedbackExecutor)
+  boost::shared_ptr<KeyedThreadPool> feedback_executor_;
+  bool coalesce_pose_updates_;
 
   // topic namespace to use
   std::string topic_ns_;
   
-  mutable boost::recursive_mutex mutex_;
+  // held shared by readers and for staging pose updates,
+  // exclusively for everything else
+  mutable boost::shared_mutex mutex_;
 
   // these are needed when spinning up a dedicated thread
-  boost::scoped_ptr<boost::thread> spin_thread_;
+  boost::thread_group spin_threads_;
   ros::NodeHandle node_handle_;
   ros::CallbackQueue callback_queue_;
-  volatile bool need_to_terminate_;
+  boost::atomic<bool> need_to_terminate_;
 
   // this is needed when running in non-threaded mode
   ros::Timer keep_alive_timer_;
 
   ros::Publisher init_pub_;
   ros::Publisher update_pub_;
+  // only used if separate_pose_channel_ is set
+  ros::Publisher pose_pub_;
+  bool separate_pose_channel_;
   ros::Subscriber feedback_sub_;
 
   uint64_t seq_num_;
@@ -50,6 +50,14 @@ INTERACTIVE_MARKERS_PUBLIC
 void autoComplete( const visualization_msgs::InteractiveMarker &msg,
     visualization_msgs::InteractiveMarkerControl &control, bool enable_autocomplete_transparency = true );
 
+/** @brief check if autoComplete() has nothing to fill in or correct.
+ *
+ * Marker ids that are already unique within the interactive marker are accepted,
+ * although autoComplete() would renumber them.
+ * @param msg      interactive marker to be checked */
+INTERACTIVE_MARKERS_PUBLIC
+bool isAutoCompleted( const visualization_msgs::InteractiveMarker &msg, bool enable_autocomplete_transparency = true );
+
 /** @brief Make sure all the control names are unique within the given msg.
  *
  * Appends _u0 _u1 etc to repeated names (not including the first of each).
@@ -96,6 +104,19 @@ void assignDefaultColor(visualization_msgs::Marker &marker, const geometry_msgs:
 INTERACTIVE_MARKERS_PUBLIC
 visualization_msgs::InteractiveMarkerControl makeTitle( const visualization_msgs::InteractiveMarker &msg );
 
+/// --- tile helpers ---
+
+/// get the index of the tile containing the given position, for a server
+/// that publishes its markers in tiles (see InteractiveMarkerServer::setTileSize())
+/// @param tile_size  edge length of the tiles
+INTERACTIVE_MARKERS_PUBLIC
+void getTileIndex( double x, double y, double tile_size, int &tile_x, int &tile_y );
+
+/// make the name of the tile with the given index, e.g. "x3_yn2" for (3,-2).
+/// The tile is published on topic_ns/tiles/<name>/update and topic_ns/tiles/<name>/update_full.
+INTERACTIVE_MARKERS_PUBLIC
+std::string makeTileName( int tile_x, int tile_y );
+
 }
 
 #endif
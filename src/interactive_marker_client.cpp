@@ -31,10 +31,15 @@
 
 #include "interactive_markers/interactive_marker_client.h"
 #include "interactive_markers/detail/single_client.h"
+#include "interactive_markers/tools.h"
+
+#include <ros/master.h>
 
 #include <boost/bind.hpp>
 #include <boost/make_shared.hpp>
 
+#include <set>
+
 //#define DBG_MSG( ... ) ROS_DEBUG_NAMED( "interactive_markers", __VA_ARGS__ );
 #define DBG_MSG( ... ) ROS_DEBUG( __VA_ARGS__ );
 //#define DBG_MSG( ... ) printf("   "); printf( __VA_ARGS__ ); printf("\n");
@@ -47,7 +52,9 @@ InteractiveMarkerClient::InteractiveMarkerClient(
     const std::string& target_frame,
     const std::string &topic_ns )
 : state_("InteractiveMarkerClient",IDLE)
+, subscribed_to_tiles_(false)
 , tf_(tf)
+, transform_cache_(tf)
 , last_num_publishers_(0)
 , enable_autocomplete_transparency_(true)
 {
@@ -67,7 +74,23 @@ InteractiveMarkerClient::~InteractiveMarkerClient()
 /// Subscribe to given topic
 void InteractiveMarkerClient::subscribe( std::string topic_ns )
 {
-  topic_ns_ = topic_ns;
+  topic_namespaces_.assign( 1, topic_ns );
+  subscribed_to_tiles_ = false;
+  subscribeUpdate();
+  subscribeInit();
+}
+
+void InteractiveMarkerClient::subscribe( std::string topic_ns, const std::vector< std::pair<int, int> > &tiles )
+{
+  // contexts of tiles that are not part of the new set would never be updated again
+  shutdown();
+
+  topic_namespaces_.clear();
+  for ( std::size_t i = 0; i < tiles.size(); i++ )
+  {
+    topic_namespaces_.push_back( topic_ns + "/tiles/" + makeTileName( tiles[i].first, tiles[i].second ) );
+  }
+  subscribed_to_tiles_ = true;
   subscribeUpdate();
   subscribeInit();
 }
@@ -120,8 +143,10 @@ void InteractiveMarkerClient::shutdown()
 
   case INIT:
   case RUNNING:
-    init_sub_.shutdown();
-    update_sub_.shutdown();
+    init_subs_.clear();
+    update_subs_.clear();
+    pose_subs_.clear();
+    pose_topics_.clear();
     boost::lock_guard<boost::mutex> lock(publisher_contexts_mutex_);
     publisher_contexts_.clear();
     last_num_publishers_=0;
@@ -132,30 +157,109 @@ void InteractiveMarkerClient::shutdown()
 
 void InteractiveMarkerClient::subscribeUpdate()
 {
-  if ( !topic_ns_.empty() )
+  update_subs_.clear();
+  pose_subs_.clear();
+  pose_topics_.clear();
+  for ( std::size_t i = 0; i < topic_namespaces_.size(); i++ )
   {
+    const std::string &topic_ns = topic_namespaces_[i];
+    if ( topic_ns.empty() )
+    {
+      continue;
+    }
     try
     {
-      update_sub_ = nh_.subscribe( topic_ns_+"/update", 100, &InteractiveMarkerClient::processUpdate, this );
-      DBG_MSG( "Subscribed to update topic: %s", (topic_ns_+"/update").c_str() );
+      update_subs_.push_back( nh_.subscribe( topic_ns+"/update", 100, &InteractiveMarkerClient::processUpdate, this ) );
+      DBG_MSG( "Subscribed to update topic: %s", (topic_ns+"/update").c_str() );
     }
     catch( ros::Exception& e )
     {
       callbacks_.statusCb( ERROR, "General", "Error subscribing: " + std::string(e.what()) );
       return;
     }
+    // tiles send their poses with the other changes
+    if ( !subscribed_to_tiles_ )
+    {
+      pose_topics_.push_back( topic_ns+"/update_poses" );
+    }
   }
+  subscribePoseUpdates();
   callbacks_.statusCb( OK, "General", "Waiting for messages.");
 }
 
+void InteractiveMarkerClient::subscribePoseUpdates()
+{
+  last_pose_topic_check_ = ros::WallTime::now();
+  if ( pose_topics_.empty() )
+  {
+    return;
+  }
+
+  // Most servers don't use the pose channel, so it is only subscribed once advertised.
+  ros::master::V_TopicInfo topics;
+  if ( !ros::master::getTopics( topics ) )
+  {
+    return;
+  }
+  std::set<std::string> advertised;
+  for ( std::size_t i = 0; i < topics.size(); i++ )
+  {
+    advertised.insert( topics[i].name );
+  }
+
+  bool subscribed = false;
+  std::vector<std::string>::iterator it = pose_topics_.begin();
+  while ( it != pose_topics_.end() )
+  {
+    if ( advertised.find( nh_.resolveName( *it ) ) == advertised.end() )
+    {
+      ++it;
+      continue;
+    }
+    try
+    {
+      pose_subs_.push_back( nh_.subscribe( *it, 100, &InteractiveMarkerClient::processPoseUpdate, this ) );
+      DBG_MSG( "Subscribed to pose update topic: %s", it->c_str() );
+      subscribed = true;
+    }
+    catch( ros::Exception& e )
+    {
+      callbacks_.statusCb( ERROR, "General", "Error subscribing: " + std::string(e.what()) );
+    }
+    it = pose_topics_.erase( it );
+  }
+
+  if ( subscribed )
+  {
+    // We can't tell which server is on that channel, so all of them tolerate overtaken updates.
+    boost::lock_guard<boost::mutex> lock(publisher_contexts_mutex_);
+    M_SingleClient::iterator context_it;
+    for ( context_it = publisher_contexts_.begin(); context_it != publisher_contexts_.end(); ++context_it )
+    {
+      context_it->second->enableReordering();
+    }
+  }
+}
+
 void InteractiveMarkerClient::subscribeInit()
 {
-  if ( state_ != INIT && !topic_ns_.empty() )
+  if ( state_ == INIT )
   {
+    return;
+  }
+
+  init_subs_.clear();
+  for ( std::size_t i = 0; i < topic_namespaces_.size(); i++ )
+  {
+    const std::string &topic_ns = topic_namespaces_[i];
+    if ( topic_ns.empty() )
+    {
+      continue;
+    }
     try
     {
-      init_sub_ = nh_.subscribe( topic_ns_+"/update_full", 100, &InteractiveMarkerClient::processInit, this );
-      DBG_MSG( "Subscribed to init topic: %s", (topic_ns_+"/update_full").c_str() );
+      init_subs_.push_back( nh_.subscribe( topic_ns+"/update_full", 100, &InteractiveMarkerClient::processInit, this ) );
+      DBG_MSG( "Subscribed to init topic: %s", (topic_ns+"/update_full").c_str() );
       state_ = INIT;
     }
     catch( ros::Exception& e )
@@ -165,8 +269,30 @@ void InteractiveMarkerClient::subscribeInit()
   }
 }
 
+uint32_t InteractiveMarkerClient::getNumUpdatePublishers() const
+{
+  uint32_t num_publishers = 0;
+  for ( std::size_t i = 0; i < update_subs_.size(); i++ )
+  {
+    num_publishers += update_subs_[i].getNumPublishers();
+  }
+  return num_publishers;
+}
+
+bool InteractiveMarkerClient::hasPosePublishers() const
+{
+  for ( std::size_t i = 0; i < pose_subs_.size(); i++ )
+  {
+    if ( pose_subs_[i].getNumPublishers() > 0 )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
 template<class MsgConstPtrT>
-void InteractiveMarkerClient::process( const MsgConstPtrT& msg )
+void InteractiveMarkerClient::process( const MsgConstPtrT& msg, bool pose_channel )
 {
   callbacks_.statusCb( OK, "General", "Receiving messages.");
 
@@ -190,7 +316,14 @@ void InteractiveMarkerClient::process( const MsgConstPtrT& msg )
     {
       DBG_MSG( "New publisher detected: %s", msg->server_id.c_str() );
 
-      SingleClientPtr pc(new SingleClient( msg->server_id, tf_, target_frame_, callbacks_ ));
+      SingleClientPtr pc(new SingleClient( msg->server_id, transform_cache_, target_frame_, callbacks_ ));
+
+      // The first update might already be overtaken by one from the pose channel.
+      // We can't tell which server is on that channel, so all of them tolerate it.
+      if ( pose_channel || hasPosePublishers() )
+      {
+        pc->enableReordering();
+      }
       context_it = publisher_contexts_.insert( std::make_pair(msg->server_id,pc) ).first;
       client = pc;
 
@@ -199,6 +332,10 @@ void InteractiveMarkerClient::process( const MsgConstPtrT& msg )
     }
 
     client = context_it->second;
+    if ( pose_channel )
+    {
+      client->enableReordering();
+    }
   }
 
   // forward init/update to respective context
@@ -215,6 +352,11 @@ void InteractiveMarkerClient::processUpdate( const UpdateConstPtr& msg )
   process<UpdateConstPtr>(msg);
 }
 
+void InteractiveMarkerClient::processPoseUpdate( const UpdateConstPtr& msg )
+{
+  process<UpdateConstPtr>(msg, true);
+}
+
 void InteractiveMarkerClient::update()
 {
   switch ( state_ )
@@ -225,8 +367,10 @@ void InteractiveMarkerClient::update()
   case INIT:
   case RUNNING:
   {
-    // check if one publisher has gone offline
-    if ( update_sub_.getNumPublishers() < last_num_publishers_ )
+    // check if one publisher has gone offline. Empty tiles are shut down
+    // by the server, their clients just don't get any more updates.
+    uint32_t num_publishers = getNumUpdatePublishers();
+    if ( num_publishers < last_num_publishers_ && !subscribed_to_tiles_ )
     {
       callbacks_.statusCb( ERROR, "General", "Server is offline. Resetting." );
       shutdown();
@@ -234,12 +378,33 @@ void InteractiveMarkerClient::update()
       subscribeInit();
       return;
     }
-    last_num_publishers_ = update_sub_.getNumPublishers();
+    last_num_publishers_ = num_publishers;
+
+    // servers might have switched to the pose channel meanwhile
+    if ( !pose_topics_.empty() && ros::WallTime::now() - last_pose_topic_check_ > ros::WallDuration( 1.0 ) )
+    {
+      subscribePoseUpdates();
+    }
+
+    // Markers mostly share their frames and time stamps, so each transform
+    // is only looked up once per call. Next time, there might be new tf data.
+    transform_cache_.clear();
 
     // check if all single clients are finished with the init channels
     bool initialized = true;
     boost::lock_guard<boost::mutex> lock(publisher_contexts_mutex_);
     M_SingleClient::iterator it;
+
+    if ( transform_pool_ )
+    {
+      // no user code is called here, so the map stays as it is
+      for ( it = publisher_contexts_.begin(); it!=publisher_contexts_.end(); ++it )
+      {
+        transform_pool_->post( it->first, boost::bind( &SingleClient::updateTf, it->second ) );
+      }
+      transform_pool_->waitIdle();
+    }
+
     for ( it = publisher_contexts_.begin(); it!=publisher_contexts_.end(); ++it )
     {
       // Explicitly reference the pointer to the client here, because the client
@@ -247,7 +412,14 @@ void InteractiveMarkerClient::update()
       // the publisher_contexts_ map...
 
       SingleClientPtr single_client = it->second;
-      single_client->update();
+      if ( transform_pool_ )
+      {
+        single_client->deliver();
+      }
+      else
+      {
+        single_client->update();
+      }
       if ( !single_client->isInitialized() )
       {
         initialized = false;
@@ -258,7 +430,7 @@ void InteractiveMarkerClient::update()
     }
     if ( state_ == INIT && initialized )
     {
-      init_sub_.shutdown();
+      init_subs_.clear();
       state_ = RUNNING;
     }
     if ( state_ == RUNNING && !initialized )
@@ -270,6 +442,16 @@ void InteractiveMarkerClient::update()
   }
 }
 
+void InteractiveMarkerClient::setNumTransformThreads( unsigned int num_threads )
+{
+  boost::lock_guard<boost::mutex> lock(publisher_contexts_mutex_);
+  transform_pool_.reset();
+  if ( num_threads > 0 )
+  {
+    transform_pool_.reset( new KeyedThreadPool( num_threads, 0 ) );
+  }
+}
+
 void InteractiveMarkerClient::statusCb( StatusT status, const std::string& server_id, const std::string& msg )
 {
   switch ( status )
@@ -31,16 +31,36 @@
 
 #include "interactive_markers/interactive_marker_server.h"
 
-#include <visualization_msgs/InteractiveMarkerInit.h>
-
 #include <boost/bind.hpp>
 #include <boost/make_shared.hpp>
 
+#include <algorithm>
+#include <utility>
+
 namespace interactive_markers
 {
 
-InteractiveMarkerServer::InteractiveMarkerServer( const std::string &topic_ns, const std::string &server_id, bool spin_thread ) :
+const InteractiveMarkerServer::MarkerHandle InteractiveMarkerServer::INVALID_HANDLE;
+
+// granularity of the expiry deadlines. Markers only expire in applyChanges()
+// and keepAlive(), so their lifetimes are less precise than that.
+static const uint64_t EXPIRY_TICK_NSEC = 10000000;
+
+InteractiveMarkerServer::InteractiveMarkerServer( const std::string &topic_ns, const std::string &server_id, bool spin_thread,
+    unsigned int num_spin_threads ) :
+    clear_pending_(false),
+    init_dirty_(true),
+    lazy_init_(false),
+    max_update_size_(0),
+    max_bandwidth_(0),
+    bandwidth_tokens_(0),
+    suppress_redundant_updates_(false),
+    expiry_wheel_(ros::Time::now().toNSec() / EXPIRY_TICK_NSEC),
+    lock_free_updates_(false),
+    coalesce_pose_updates_(false),
     topic_ns_(topic_ns),
+    need_to_terminate_(false),
+    separate_pose_channel_(false),
     seq_num_(0)
 {
   if ( spin_thread )
@@ -58,11 +78,15 @@ InteractiveMarkerServer::InteractiveMarkerServer( const std::string &topic_ns, c
     server_id_ = ros::this_node::getName();
   }
 
+  init_msg_.server_id = server_id_;
+
   std::string update_topic = topic_ns + "/update";
   std::string init_topic = update_topic + "_full";
   std::string feedback_topic = topic_ns + "/feedback";
 
-  init_pub_ = node_handle_.advertise<visualization_msgs::InteractiveMarkerInit>( init_topic, 100, true );
+  init_pub_ = node_handle_.advertise<visualization_msgs::InteractiveMarkerInit>( init_topic, 100,
+      boost::bind( &InteractiveMarkerServer::initSubscriberConnected, this, _1 ),
+      ros::SubscriberStatusCallback(), ros::VoidConstPtr(), true );
   update_pub_ = node_handle_.advertise<visualization_msgs::InteractiveMarkerUpdate>( update_topic, 100 );
   feedback_sub_ = node_handle_.subscribe( feedback_topic, 100, &InteractiveMarkerServer::processFeedback, this );
 
@@ -70,427 +94,1918 @@ InteractiveMarkerServer::InteractiveMarkerServer( const std::string &topic_ns, c
 
   if ( spin_thread )
   {
-    need_to_terminate_ = false;
-    spin_thread_.reset( new boost::thread(boost::bind(&InteractiveMarkerServer::spinThread, this)) );
+    for ( unsigned int i = 0; i < std::max( num_spin_threads, 1u ); i++ )
+    {
+      spin_threads_.create_thread( boost::bind( &InteractiveMarkerServer::spinThread, this ) );
+    }
   }
 
+  // the spin threads might already be running
+  WriteLock lock( mutex_ );
   publishInit();
 }
 
 
 InteractiveMarkerServer::~InteractiveMarkerServer()
 {
-  if (spin_thread_.get())
+  if ( spin_threads_.size() > 0 )
   {
     need_to_terminate_ = true;
-    spin_thread_->join();
+    // wakes up all threads waiting for callbacks
+    callback_queue_.disable();
+    spin_threads_.join_all();
   }
 
+  // finish running callbacks while the rest of the server still works
+  setFeedbackExecutor( 0 );
+
   if ( node_handle_.ok() )
   {
     clear();
     applyChanges();
   }
+
+  // send what is still queued while the publishers exist
+  setAsyncPublishing( false );
 }
 
 
 void InteractiveMarkerServer::spinThread()
 {
-  while (node_handle_.ok())
+  while ( node_handle_.ok() && !need_to_terminate_ )
   {
-    if (need_to_terminate_)
-    {
-      break;
-    }
-    callback_queue_.callAvailable(ros::WallDuration(0.033f));
+    // Returns as soon as there are callbacks to call or the queue is disabled.
+    // ROS can't tell us when the node shuts down, so we check that after the timeout.
+    callback_queue_.callAvailable( ros::WallDuration( 0.1 ) );
   }
 }
 
 
 void InteractiveMarkerServer::applyChanges()
 {
-  boost::recursive_mutex::scoped_lock lock( mutex_ );
+  // Pose updates are only staged with a shared lock, so once we hold the
+  // exclusive one, we see a consistent snapshot of all changes.
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+  expireMarkers();
+  flush( true );
+}
 
-  if ( pending_updates_.empty() )
+void InteractiveMarkerServer::flush( bool apply_changes )
+{
+  if ( deferred_slots_.empty() &&
+      ( !apply_changes || ( dirty_slots_.empty() && !hasStagedPoses() && !clear_pending_ ) ) )
   {
     return;
   }
 
-  M_UpdateContext::iterator update_it;
-
-  visualization_msgs::InteractiveMarkerUpdate update;
+  SharedMarkerUpdate update;
   update.type = visualization_msgs::InteractiveMarkerUpdate::UPDATE;
 
-  update.markers.reserve( marker_contexts_.size() );
-  update.poses.reserve( marker_contexts_.size() );
-  update.erases.reserve( marker_contexts_.size() );
+  // full updates which might have to wait for bandwidth
+  std::vector<uint32_t> full_updates;
 
-  for ( update_it = pending_updates_.begin(); update_it != pending_updates_.end(); update_it++ )
+  if ( apply_changes )
   {
-    M_MarkerContext::iterator marker_context_it = marker_contexts_.find( update_it->first );
-
-    switch ( update_it->second.update_type )
-    {
-      case UpdateContext::FULL_UPDATE:
-      {
-        if ( marker_context_it == marker_contexts_.end() )
-        {
-          ROS_DEBUG("Creating new context for %s", update_it->first.c_str());
-          // create a new int_marker context
-          marker_context_it = marker_contexts_.insert( std::make_pair( update_it->first, MarkerContext() ) ).first;
-          // copy feedback cbs, in case they have been set before the marker context was created
-          marker_context_it->second.default_feedback_cb = update_it->second.default_feedback_cb;
-          marker_context_it->second.feedback_cbs = update_it->second.feedback_cbs;
-        }
+    update.markers.reserve( dirty_slots_.size() );
+    update.poses.reserve( dirty_slots_.size() + numStagedPoses() );
+    update.erases.reserve( dirty_slots_.size() );
 
-        marker_context_it->second.int_marker = update_it->second.int_marker;
+    // this has to happen first, as it checks which slots have pending updates
+    flushStagedPoses( update );
 
-        update.markers.push_back( marker_context_it->second.int_marker );
-        break;
-      }
+    if ( clear_pending_ )
+    {
+      eraseCleared( update );
+    }
 
-      case UpdateContext::POSE_UPDATE:
+    for ( std::size_t i = 0; i < dirty_slots_.size(); i++ )
+    {
+      uint32_t slot_index = dirty_slots_[i];
+      if ( max_bandwidth_ > 0 && slots_[slot_index].update_context.update_type == UpdateContext::FULL_UPDATE )
       {
-        if ( marker_context_it == marker_contexts_.end() )
-        {
-          ROS_ERROR( "Pending pose update for non-existing marker found. This is a bug in InteractiveMarkerInterface." );
-        }
-        else
-        {
-          marker_context_it->second.int_marker.pose = update_it->second.int_marker.pose;
-          marker_context_it->second.int_marker.header = update_it->second.int_marker.header;
-
-          visualization_msgs::InteractiveMarkerPose pose_update;
-          pose_update.header = marker_context_it->second.int_marker.header;
-          pose_update.pose = marker_context_it->second.int_marker.pose;
-          pose_update.name = marker_context_it->second.int_marker.name;
-          update.poses.push_back( pose_update );
-        }
-        break;
+        full_updates.push_back( slot_index );
       }
-
-      case UpdateContext::ERASE:
+      else
       {
-        if ( marker_context_it != marker_contexts_.end() )
-        {
-          marker_contexts_.erase( update_it->first );
-          update.erases.push_back( update_it->first );
-        }
-        break;
+        commitSlot( slot_index, update );
       }
     }
+    dirty_slots_.clear();
   }
 
-  seq_num_++;
-
-  publish( update );
-  publishInit();
-  pending_updates_.clear();
-}
-
-
-bool InteractiveMarkerServer::erase( const std::string &name )
-{
-  boost::recursive_mutex::scoped_lock lock( mutex_ );
-
-  if (marker_contexts_.end() == marker_contexts_.find(name) &&
-      pending_updates_.end() == pending_updates_.find(name))
+  for ( std::size_t i = 0; i < deferred_slots_.size(); i++ )
   {
-    return false;
+    // slots that have been changed since are in dirty_slots_
+    if ( slots_[deferred_slots_[i]].deferred )
+    {
+      slots_[deferred_slots_[i]].deferred = false;
+      full_updates.push_back( deferred_slots_[i] );
+    }
   }
-  pending_updates_[name].update_type = UpdateContext::ERASE;
-  return true;
-}
-
-void InteractiveMarkerServer::clear()
-{
-  boost::recursive_mutex::scoped_lock lock( mutex_ );
+  deferred_slots_.clear();
 
-  // erase all markers
-  pending_updates_.clear();
-  M_MarkerContext::iterator it;
-  for ( it = marker_contexts_.begin(); it != marker_contexts_.end(); it++ )
+  if ( max_bandwidth_ > 0 )
   {
-    pending_updates_[it->first].update_type = UpdateContext::ERASE;
+    commitFullUpdates( full_updates, update );
+  }
+  else
+  {
+    for ( std::size_t i = 0; i < full_updates.size(); i++ )
+    {
+      commitSlot( full_updates[i], update );
+    }
   }
-}
-
-
-bool InteractiveMarkerServer::empty() const
-{
-  return marker_contexts_.empty();
-}
 
+  // nothing has changed for the clients
+  if ( update.markers.empty() && update.poses.empty() && update.erases.empty() )
+  {
+    return;
+  }
 
-std::size_t InteractiveMarkerServer::size() const
-{
-  return marker_contexts_.size();
+  publishUpdate( update );
+  init_dirty_ = true;
+  publishInitIfDue();
 }
 
-
-bool InteractiveMarkerServer::setPose( const std::string &name, const geometry_msgs::Pose &pose, const std_msgs::Header &header )
+void InteractiveMarkerServer::commitFullUpdates( std::vector<uint32_t> &slot_indices, SharedMarkerUpdate &update )
 {
-  boost::recursive_mutex::scoped_lock lock( mutex_ );
-
-  M_MarkerContext::iterator marker_context_it = marker_contexts_.find( name );
-  M_UpdateContext::iterator update_it = pending_updates_.find( name );
-
-  // if there's no marker and no pending addition for it, we can't update the pose
-  if ( marker_context_it == marker_contexts_.end() &&
-      ( update_it == pending_updates_.end() || update_it->second.update_type != UpdateContext::FULL_UPDATE ) )
+  namespace ser = ros::serialization;
+
+  // the pose updates and erases always go out, but count against the budget
+  ros::WallTime now = ros::WallTime::now();
+  bandwidth_tokens_ = std::min( bandwidth_tokens_ + ( now - last_bandwidth_refill_ ).toSec() * max_bandwidth_,
+      max_bandwidth_ );
+  last_bandwidth_refill_ = now;
+  bandwidth_tokens_ -= ser::serializationLength( update );
+
+  // markers the user has interacted with most recently go first
+  std::vector< std::pair<ros::Time, uint32_t> > order;
+  order.reserve( slot_indices.size() );
+  for ( std::size_t i = 0; i < slot_indices.size(); i++ )
   {
-    return false;
+    const MarkerSlot &slot = slots_[slot_indices[i]];
+    order.push_back( std::make_pair( slot.committed ? slot.marker_context.last_feedback : ros::Time(), slot_indices[i] ) );
   }
+  std::stable_sort( order.begin(), order.end(), compareFeedbackTime );
 
-  // keep the old header
-  if ( header.frame_id.empty() )
+  for ( std::size_t i = 0; i < order.size(); i++ )
   {
-    if ( marker_context_it != marker_contexts_.end() )
-    {
-      doSetPose( update_it, name, pose, marker_context_it->second.int_marker.header );
-    }
-    else if ( update_it != pending_updates_.end() )
+    uint32_t slot_index = order[i].second;
+
+    // we allow going into debt for one marker, so that large ones are not starved
+    if ( bandwidth_tokens_ > 0 )
     {
-      doSetPose( update_it, name, pose, update_it->second.int_marker.header );
+      // Only pay for what is sent. A redundant marker (see setSuppressRedundantUpdates)
+      // turns into a pose update or nothing at all.
+      std::size_t num_markers = update.markers.size();
+      std::size_t num_poses = update.poses.size();
+      commitSlot( slot_index, update );
+      for ( std::size_t m = num_markers; m < update.markers.size(); m++ )
+      {
+        bandwidth_tokens_ -= ser::serializationLength( update.markers[m] );
+      }
+      for ( std::size_t p = num_poses; p < update.poses.size(); p++ )
+      {
+        bandwidth_tokens_ -= ser::serializationLength( update.poses[p] );
+      }
+      continue;
     }
-    else
+
+    // Keep the update pending until there is enough bandwidth. The clients can
+    // still see where the existing marker is moved to in the meantime.
+    MarkerSlot &slot = slots_[slot_index];
+    slot.deferred = true;
+    deferred_slots_.push_back( slot_index );
+    if ( slot.committed )
     {
-      BOOST_ASSERT_MSG(false, "Marker does not exist and there is no pending creation.");
-      return false;
+      const SharedMarker &marker = slot.update_context.marker;
+      const SharedMarker &committed = committedMarker( slot );
+      if ( !isSameHeader( committed.header, marker.header ) || !isSamePose( committed.pose, marker.pose ) )
+      {
+        commitPose( slot_index, marker.header, marker.pose, update );
+      }
     }
   }
-  else
+
+  if ( !deferred_slots_.empty() )
   {
-    doSetPose( update_it, name, pose, header );
+    ROS_DEBUG( "Deferring %zu marker updates due to bandwidth limit.", deferred_slots_.size() );
   }
-  return true;
 }
 
-bool InteractiveMarkerServer::setCallback( const std::string &name, FeedbackCallback feedback_cb, uint8_t feedback_type  )
+bool InteractiveMarkerServer::compareFeedbackTime( const std::pair<ros::Time, uint32_t> &a, const std::pair<ros::Time, uint32_t> &b )
 {
-  boost::recursive_mutex::scoped_lock lock( mutex_ );
-
-  M_MarkerContext::iterator marker_context_it = marker_contexts_.find( name );
-  M_UpdateContext::iterator update_it = pending_updates_.find( name );
-
-  if ( marker_context_it == marker_contexts_.end() && update_it == pending_updates_.end() )
-  {
-    return false;
-  }
+  return a.first > b.first;
+}
 
-  // we need to overwrite both the callbacks for the actual marker
-  // and the update, if there's any
+void InteractiveMarkerServer::commitSlot( uint32_t slot_index, SharedMarkerUpdate &update )
+{
+  MarkerSlot &slot = slots_[slot_index];
+  UpdateContext &update_context = slot.update_context;
 
-  if ( marker_context_it != marker_contexts_.end() )
+  switch ( update_context.update_type )
   {
-    // the marker exists, so we can just overwrite the existing callbacks
-    if ( feedback_type == DEFAULT_FEEDBACK_CB )
-    {
-      marker_context_it->second.default_feedback_cb = feedback_cb;
-    }
-    else
+    case UpdateContext::FULL_UPDATE:
     {
-      if ( feedback_cb )
+      if ( !slot.committed )
+      {
+        ROS_DEBUG("Creating new context for %s", slot.name.c_str());
+        // create a new int_marker context
+        slot.committed = true;
+        slot.marker_context = MarkerContext();
+        // copy feedback cbs, in case they have been set before the marker context was created
+        slot.marker_context.default_feedback_cb = update_context.default_feedback_cb;
+        slot.marker_context.feedback_cbs = update_context.feedback_cbs;
+        slot.marker_context.init_index = init_msg_.markers.size();
+        slot.marker_context.content_hash = update_context.content_hash;
+        init_msg_.markers.push_back( update_context.marker );
+        init_slots_.push_back( slot_index );
+      }
+      else if ( update_context.content_hash != 0 &&
+          update_context.content_hash == slot.marker_context.content_hash &&
+          isSameMarkerContents( *committedMarker( slot ).int_marker, *update_context.marker.int_marker, hash_buffer_ ) )
       {
-        marker_context_it->second.feedback_cbs[feedback_type] = feedback_cb;
+        // the clients already have these contents, at most the pose has changed
+        const SharedMarker &marker = committedMarker( slot );
+        if ( !isSameHeader( marker.header, update_context.marker.header ) ||
+            !isSamePose( marker.pose, update_context.marker.pose ) )
+        {
+          commitPose( slot_index, update_context.marker.header, update_context.marker.pose, update );
+        }
+        break;
       }
       else
       {
-        marker_context_it->second.feedback_cbs.erase( feedback_type );
+        committedMarker( slot ) = update_context.marker;
+        slot.marker_context.content_hash = update_context.content_hash;
       }
-    }
-  }
 
-  if ( update_it != pending_updates_.end() )
-  {
-    if ( feedback_type == DEFAULT_FEEDBACK_CB )
-    {
-      update_it->second.default_feedback_cb = feedback_cb;
+      update.markers.push_back( committedMarker( slot ) );
+      break;
     }
-    else
+
+    case UpdateContext::POSE_UPDATE:
     {
-      if ( feedback_cb )
+      if ( !slot.committed )
       {
-        update_it->second.feedback_cbs[feedback_type] = feedback_cb;
+        ROS_ERROR( "Pending pose update for non-existing marker found. This is a bug in InteractiveMarkerInterface." );
       }
       else
       {
-        update_it->second.feedback_cbs.erase( feedback_type );
+        commitPose( slot_index, update_context.marker.header, update_context.marker.pose, update );
+      }
+      break;
+    }
+
+    case UpdateContext::ERASE:
+    {
+      if ( slot.committed )
+      {
+        eraseCommitted( slot_index );
+        update.erases.push_back( slot.name );
       }
+      break;
     }
   }
-  return true;
+
+  slot.pending = false;
+  slot.update_context = UpdateContext();
+  releaseSlotIfUnused( slot_index );
 }
 
-void InteractiveMarkerServer::insert( const visualization_msgs::InteractiveMarker &int_marker )
+void InteractiveMarkerServer::commitPose( uint32_t slot_index, const std_msgs::Header &header,
+    const geometry_msgs::Pose &pose, SharedMarkerUpdate &update )
 {
-  boost::recursive_mutex::scoped_lock lock( mutex_ );
+  const MarkerSlot &slot = slots_[slot_index];
+  SharedMarker &marker = committedMarker( slot );
+  marker.header = header;
+  marker.pose = pose;
+
+  update.poses.push_back( visualization_msgs::InteractiveMarkerPose() );
+  visualization_msgs::InteractiveMarkerPose &pose_update = update.poses.back();
+  pose_update.header = header;
+  pose_update.pose = pose;
+  pose_update.name = slot.name;
+}
+
 
-  M_UpdateContext::iterator update_it = pending_updates_.find( int_marker.name );
-  if ( update_it == pending_updates_.end() )
+bool InteractiveMarkerServer::erase( const std::string &name )
+{
+  if ( lock_free_updates_ )
   {
-    update_it = pending_updates_.insert( std::make_pair( int_marker.name, UpdateContext() ) ).first;
+    QueuedUpdate update;
+    update.update_type = QueuedUpdate::ERASE;
+    setQueuedMarker( update, name );
+    update_queue_.push( update );
+    return true;
   }
 
-  update_it->second.update_type = UpdateContext::FULL_UPDATE;
-  update_it->second.int_marker = int_marker;
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+
+  uint32_t slot_index = findSlot( name );
+  if ( slot_index == NO_SLOT )
+  {
+    return false;
+  }
+  return doErase( slot_index );
 }
 
-void InteractiveMarkerServer::insert( const visualization_msgs::InteractiveMarker &int_marker,
-    FeedbackCallback feedback_cb, uint8_t feedback_type)
+bool InteractiveMarkerServer::erase( MarkerHandle handle )
 {
-  insert( int_marker );
+  if ( lock_free_updates_ )
+  {
+    QueuedUpdate update;
+    update.update_type = QueuedUpdate::ERASE;
+    setQueuedMarker( update, handle );
+    update_queue_.push( update );
+    return true;
+  }
+
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
 
-  setCallback( int_marker.name, feedback_cb, feedback_type  );
+  uint32_t slot_index = findSlot( handle );
+  if ( slot_index == NO_SLOT )
+  {
+    return false;
+  }
+  return doErase( slot_index );
 }
 
-bool InteractiveMarkerServer::get( std::string name, visualization_msgs::InteractiveMarker &int_marker ) const
+bool InteractiveMarkerServer::doErase( uint32_t slot_index )
 {
-  boost::recursive_mutex::scoped_lock lock( mutex_ );
+  pendingUpdate( slot_index ).update_type = UpdateContext::ERASE;
+  updateSpatialIndex( slot_index );
+  return true;
+}
 
-  M_UpdateContext::const_iterator update_it = pending_updates_.find( name );
+void InteractiveMarkerServer::clear()
+{
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
 
-  if ( update_it == pending_updates_.end() )
+  // drop all pending updates
+  std::vector<uint32_t> dirty_slots;
+  dirty_slots.swap( dirty_slots_ );
+  for ( std::size_t i = 0; i < dirty_slots.size(); i++ )
+  {
+    slots_[dirty_slots[i]].pending = false;
+    slots_[dirty_slots[i]].update_context = UpdateContext();
+    releaseSlotIfUnused( dirty_slots[i] );
+  }
+  for ( std::size_t i = 0; i < deferred_slots_.size(); i++ )
   {
-    M_MarkerContext::const_iterator marker_context_it = marker_contexts_.find( name );
-    if ( marker_context_it == marker_contexts_.end() )
+    MarkerSlot &slot = slots_[deferred_slots_[i]];
+    if ( slot.deferred )
     {
-      return false;
+      slot.deferred = false;
+      slot.pending = false;
+      slot.update_context = UpdateContext();
+      releaseSlotIfUnused( deferred_slots_[i] );
     }
+  }
+  deferred_slots_.clear();
 
-    int_marker = marker_context_it->second.int_marker;
-    return true;
+  // drop all staged poses
+  for ( std::size_t shard_index = 0; shard_index < NUM_POSE_SHARDS; shard_index++ )
+  {
+    PoseStaging &shard = staged_poses_[shard_index];
+    for ( std::size_t i = 0; i < shard.slots.size(); i++ )
+    {
+      slots_[shard.slots[i]].staged_index = NO_SLOT;
+    }
+    shard.clear();
   }
 
-  // if there's an update pending, we'll have to account for that
-  switch ( update_it->second.update_type )
+  if ( spatial_index_ )
   {
-    case UpdateContext::ERASE:
-      return false;
+    spatial_index_->clear();
+  }
 
-    case UpdateContext::POSE_UPDATE:
+  // Instead of scheduling an erase for every marker, mark them all as gone at once.
+  // applyChanges() erases the ones that haven't been inserted again in the meantime.
+  if ( !init_slots_.empty() )
+  {
+    clear_pending_ = true;
+  }
+}
+
+void InteractiveMarkerServer::eraseCleared( SharedMarkerUpdate &update )
+{
+  clear_pending_ = false;
+  update.erases.reserve( update.erases.size() + init_slots_.size() );
+
+  // compact init_msg_ in one pass, keeping the markers with pending updates
+  std::size_t num_kept = 0;
+  for ( std::size_t i = 0; i < init_slots_.size(); i++ )
+  {
+    uint32_t slot_index = init_slots_[i];
+    MarkerSlot &slot = slots_[slot_index];
+
+    // inserted or erased again since, commitSlot() will take care of it
+    if ( slot.pending )
     {
-      M_MarkerContext::const_iterator marker_context_it = marker_contexts_.find( name );
-      if ( marker_context_it == marker_contexts_.end() )
+      if ( num_kept != i )
       {
-        return false;
+        init_msg_.markers[num_kept] = std::move( init_msg_.markers[i] );
+        init_slots_[num_kept] = slot_index;
+        slot.marker_context.init_index = num_kept;
       }
-      int_marker = marker_context_it->second.int_marker;
-      int_marker.pose = update_it->second.int_marker.pose;
-      return true;
+      num_kept++;
+      continue;
     }
 
-    case UpdateContext::FULL_UPDATE:
-      int_marker = update_it->second.int_marker;
-      return true;
+    update.erases.push_back( slot.name );
+    slot.committed = false;
+    slot.marker_context = MarkerContext();
+    releaseSlotIfUnused( slot_index );
   }
 
-  return false;
+  init_msg_.markers.resize( num_kept );
+  init_slots_.resize( num_kept );
 }
 
-void InteractiveMarkerServer::publishInit()
+std::size_t InteractiveMarkerServer::eraseIf( const boost::function< bool ( const std::string& ) > &predicate )
 {
-  boost::recursive_mutex::scoped_lock lock( mutex_ );
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
 
-  visualization_msgs::InteractiveMarkerInit init;
-  init.server_id = server_id_;
-  init.seq_num = seq_num_;
-  init.markers.reserve( marker_contexts_.size() );
-
-  M_MarkerContext::iterator it;
-  for ( it = marker_contexts_.begin(); it != marker_contexts_.end(); it++ )
+  std::size_t num_erased = 0;
+  for ( uint32_t slot_index = 0; slot_index < slots_.size(); slot_index++ )
   {
-    ROS_DEBUG( "Publishing %s", it->second.int_marker.name.c_str() );
-    init.markers.push_back( it->second.int_marker );
+    const MarkerSlot &slot = slots_[slot_index];
+    if ( slot.in_use && isPresent( slot ) && predicate( slot.name ) )
+    {
+      doErase( slot_index );
+      num_erased++;
+    }
   }
-
-  init_pub_.publish( init );
+  return num_erased;
 }
 
-void InteractiveMarkerServer::processFeedback( const FeedbackConstPtr& feedback )
+static bool hasPrefix( const std::string &name, const std::string &prefix )
 {
-  boost::recursive_mutex::scoped_lock lock( mutex_ );
+  return name.compare( 0, prefix.size(), prefix ) == 0;
+}
 
-  M_MarkerContext::iterator marker_context_it = marker_contexts_.find( feedback->marker_name );
+std::size_t InteractiveMarkerServer::erasePrefix( const std::string &prefix )
+{
+  return eraseIf( boost::bind( &hasPrefix, _1, boost::cref( prefix ) ) );
+}
 
-  // ignore feedback for non-existing markers
-  if ( marker_context_it == marker_contexts_.end() )
+bool InteractiveMarkerServer::isPresent( const MarkerSlot &slot ) const
+{
+  if ( !slot.pending )
   {
-    return;
+    return isLive( slot );
   }
 
-  MarkerContext &marker_context = marker_context_it->second;
-
-  // if two callers try to modify the same marker, reject (timeout= 1 sec)
-  if ( marker_context.last_client_id != feedback->client_id &&
-      (ros::Time::now() - marker_context.last_feedback).toSec() < 1.0 )
+  switch ( slot.update_context.update_type )
   {
-    ROS_DEBUG( "Rejecting feedback for %s: conflicting feedback from separate clients.", feedback->marker_name.c_str() );
-    return;
+    case UpdateContext::ERASE:
+      return false;
+    case UpdateContext::POSE_UPDATE:
+      return isLive( slot );
+    case UpdateContext::FULL_UPDATE:
+      return true;
   }
+  return false;
+}
 
-  marker_context.last_feedback = ros::Time::now();
-  marker_context.last_client_id = feedback->client_id;
 
-  if ( feedback->event_type == visualization_msgs::InteractiveMarkerFeedback::POSE_UPDATE )
-  {
-    if ( marker_context.int_marker.header.stamp == ros::Time(0) )
-    {
-      // keep the old header
-      doSetPose( pending_updates_.find( feedback->marker_name ), feedback->marker_name, feedback->pose, marker_context.int_marker.header );
-    }
-    else
-    {
-      doSetPose( pending_updates_.find( feedback->marker_name ), feedback->marker_name, feedback->pose, feedback->header );
-    }
-  }
+bool InteractiveMarkerServer::empty() const
+{
+  ReadLock lock( mutex_ );
+  return init_msg_.markers.empty();
+}
 
-  // call feedback handler
-  boost::unordered_map<uint8_t,FeedbackCallback>::iterator feedback_cb_it = marker_context.feedback_cbs.find( feedback->event_type );
-  if ( feedback_cb_it != marker_context.feedback_cbs.end() && feedback_cb_it->second )
-  {
-    // call type-specific callback
-    feedback_cb_it->second( feedback );
-  }
-  else if ( marker_context.default_feedback_cb )
-  {
-    // call default callback
-    marker_context.default_feedback_cb(  feedback );
-  }
+
+std::size_t InteractiveMarkerServer::size() const
+{
+  ReadLock lock( mutex_ );
+  return init_msg_.markers.size();
 }
 
 
-void InteractiveMarkerServer::keepAlive()
+bool InteractiveMarkerServer::setPose( const std::string &name, const geometry_msgs::Pose &pose, const std_msgs::Header &header )
 {
-  visualization_msgs::InteractiveMarkerUpdate empty_update;
-  empty_update.type = visualization_msgs::InteractiveMarkerUpdate::KEEP_ALIVE;
-  publish( empty_update );
+  return lockAndSetPose( name, pose, header );
 }
 
+bool InteractiveMarkerServer::setPose( MarkerHandle handle, const geometry_msgs::Pose &pose, const std_msgs::Header &header )
+{
+  return lockAndSetPose( handle, pose, header );
+}
 
-void InteractiveMarkerServer::publish( visualization_msgs::InteractiveMarkerUpdate &update )
+std::size_t InteractiveMarkerServer::setPoses( const std::vector<std::string> &names,
+    const std::vector<geometry_msgs::Pose> &poses, const std_msgs::Header &header )
 {
-  update.server_id = server_id_;
-  update.seq_num = seq_num_;
-  update_pub_.publish( update );
+  return lockAndSetPoses( names, poses, header );
 }
 
+std::size_t InteractiveMarkerServer::setPoses( const std::vector<MarkerHandle> &handles,
+    const std::vector<geometry_msgs::Pose> &poses, const std_msgs::Header &header )
+{
+  return lockAndSetPoses( handles, poses, header );
+}
 
-void InteractiveMarkerServer::doSetPose( M_UpdateContext::iterator update_it, const std::string &name, const geometry_msgs::Pose &pose, const std_msgs::Header &header )
+template<class Key>
+bool InteractiveMarkerServer::lockAndSetPose( const Key &key, const geometry_msgs::Pose &pose, const std_msgs::Header &header )
 {
-  if ( update_it == pending_updates_.end() )
+  if ( lock_free_updates_ )
   {
-    update_it = pending_updates_.insert( std::make_pair( name, UpdateContext() ) ).first;
-    update_it->second.update_type = UpdateContext::POSE_UPDATE;
+    QueuedUpdate update;
+    update.update_type = QueuedUpdate::POSE_UPDATE;
+    setQueuedMarker( update, key );
+    update.pose = pose;
+    update.header = header;
+    update_queue_.push( update );
+    return true;
+  }
+
+  {
+    ReadLock lock( mutex_ );
+    uint32_t slot_index = findSlot( key );
+    if ( slot_index == NO_SLOT )
+    {
+      return false;
+    }
+    // the spatial index can only be changed with the exclusive lock
+    if ( !spatial_index_ && stagePose( slot_index, pose, header ) )
+    {
+      return true;
+    }
+  }
+
+  // the marker might have changed in between, so look it up again
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+  uint32_t slot_index = findSlot( key );
+  if ( slot_index == NO_SLOT )
+  {
+    return false;
   }
-  else if ( update_it->second.update_type != UpdateContext::FULL_UPDATE )
+  return doSetPose( slot_index, pose, header );
+}
+
+template<class Key>
+std::size_t InteractiveMarkerServer::lockAndSetPoses( const std::vector<Key> &keys,
+    const std::vector<geometry_msgs::Pose> &poses, const std_msgs::Header &header )
+{
+  if ( keys.size() != poses.size() )
+  {
+    ROS_ERROR( "setPoses() called with %zu markers, but %zu poses.", keys.size(), poses.size() );
+    return 0;
+  }
+
+  if ( lock_free_updates_ )
+  {
+    QueuedUpdate update;
+    update.update_type = QueuedUpdate::POSE_UPDATE;
+    update.header = header;
+    for ( std::size_t i = 0; i < keys.size(); i++ )
+    {
+      setQueuedMarker( update, keys[i] );
+      update.pose = poses[i];
+      update_queue_.push( update );
+    }
+    return keys.size();
+  }
+
+  std::size_t num_updated = 0;
+  std::vector<std::size_t> remaining;
+  {
+    ReadLock lock( mutex_ );
+    for ( std::size_t i = 0; i < keys.size(); i++ )
+    {
+      uint32_t slot_index = findSlot( keys[i] );
+      if ( slot_index == NO_SLOT )
+      {
+        continue;
+      }
+      if ( !spatial_index_ && stagePose( slot_index, poses[i], header ) )
+      {
+        num_updated++;
+      }
+      else
+      {
+        remaining.push_back( i );
+      }
+    }
+  }
+
+  if ( remaining.empty() )
+  {
+    return num_updated;
+  }
+
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+  for ( std::size_t i = 0; i < remaining.size(); i++ )
+  {
+    uint32_t slot_index = findSlot( keys[remaining[i]] );
+    if ( slot_index != NO_SLOT && doSetPose( slot_index, poses[remaining[i]], header ) )
+    {
+      num_updated++;
+    }
+  }
+  return num_updated;
+}
+
+void InteractiveMarkerServer::setQueuedMarker( QueuedUpdate &update, const std::string &name )
+{
+  update.handle = INVALID_HANDLE;
+  update.name = name;
+}
+
+void InteractiveMarkerServer::setQueuedMarker( QueuedUpdate &update, MarkerHandle handle )
+{
+  update.handle = handle;
+}
+
+void InteractiveMarkerServer::drainUpdateQueue()
+{
+  // Applying the changes in order lets the latest one for each marker win.
+  // Pose updates only overwrite the staged pose, so this costs no more than merging them first.
+  QueuedUpdate update;
+  while ( update_queue_.pop( update ) )
+  {
+    uint32_t slot_index = update.handle != INVALID_HANDLE ? findSlot( update.handle ) : findSlot( update.name );
+    if ( slot_index == NO_SLOT )
+    {
+      continue;
+    }
+
+    switch ( update.update_type )
+    {
+      case QueuedUpdate::POSE_UPDATE:
+        doSetPose( slot_index, update.pose, update.header );
+        break;
+      case QueuedUpdate::ERASE:
+        doErase( slot_index );
+        break;
+    }
+  }
+}
+
+bool InteractiveMarkerServer::doSetPose( uint32_t slot_index, const geometry_msgs::Pose &pose, const std_msgs::Header &header )
+{
+  MarkerSlot &slot = slots_[slot_index];
+
+  // if there's no marker and no pending addition for it, we can't update the pose
+  if ( !isPresent( slot ) )
+  {
+    return false;
+  }
+
+  // plain pose update of an existing marker
+  if ( stagePose( slot_index, pose, header ) )
+  {
+    updateSpatialIndex( slot_index );
+    return true;
+  }
+
+  // keep the old header
+  if ( header.frame_id.empty() )
+  {
+    if ( isLive( slot ) )
+    {
+      schedulePoseUpdate( slot_index, pose, committedMarker( slot ).header );
+    }
+    else if ( slot.pending )
+    {
+      schedulePoseUpdate( slot_index, pose, slot.update_context.marker.header );
+    }
+    else
+    {
+      BOOST_ASSERT_MSG(false, "Marker does not exist and there is no pending creation.");
+      return false;
+    }
+  }
+  else
+  {
+    schedulePoseUpdate( slot_index, pose, header );
+  }
+  updateSpatialIndex( slot_index );
+  return true;
+}
+
+bool InteractiveMarkerServer::setCallback( const std::string &name, FeedbackCallback feedback_cb, uint8_t feedback_type  )
+{
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+
+  uint32_t slot_index = findSlot( name );
+  if ( slot_index == NO_SLOT )
+  {
+    return false;
+  }
+  return doSetCallback( slot_index, feedback_cb, feedback_type );
+}
+
+bool InteractiveMarkerServer::setCallback( MarkerHandle handle, FeedbackCallback feedback_cb, uint8_t feedback_type  )
+{
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+
+  uint32_t slot_index = findSlot( handle );
+  if ( slot_index == NO_SLOT )
+  {
+    return false;
+  }
+  return doSetCallback( slot_index, feedback_cb, feedback_type );
+}
+
+bool InteractiveMarkerServer::doSetCallback( uint32_t slot_index, FeedbackCallback feedback_cb, uint8_t feedback_type )
+{
+  MarkerSlot &slot = slots_[slot_index];
+
+  // we need to overwrite both the callbacks for the actual marker
+  // and the update, if there's any
+
+  if ( slot.committed )
+  {
+    // the marker exists, so we can just overwrite the existing callbacks
+    if ( feedback_type == DEFAULT_FEEDBACK_CB )
+    {
+      slot.marker_context.default_feedback_cb = feedback_cb;
+    }
+    else
+    {
+      if ( feedback_cb )
+      {
+        slot.marker_context.feedback_cbs[feedback_type] = feedback_cb;
+      }
+      else
+      {
+        slot.marker_context.feedback_cbs.erase( feedback_type );
+      }
+    }
+  }
+
+  if ( slot.pending )
+  {
+    if ( feedback_type == DEFAULT_FEEDBACK_CB )
+    {
+      slot.update_context.default_feedback_cb = feedback_cb;
+    }
+    else
+    {
+      if ( feedback_cb )
+      {
+        slot.update_context.feedback_cbs[feedback_type] = feedback_cb;
+      }
+      else
+      {
+        slot.update_context.feedback_cbs.erase( feedback_type );
+      }
+    }
+  }
+  return true;
+}
+
+InteractiveMarkerServer::MarkerHandle InteractiveMarkerServer::insert( const visualization_msgs::InteractiveMarker &int_marker )
+{
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+
+  // this is the only copy of the marker contents we make, everything
+  // else (including outgoing messages) refers to it
+  return doInsert( boost::make_shared<visualization_msgs::InteractiveMarker>( int_marker ) );
+}
+
+InteractiveMarkerServer::MarkerHandle InteractiveMarkerServer::insert( const visualization_msgs::InteractiveMarker &int_marker,
+    FeedbackCallback feedback_cb, uint8_t feedback_type)
+{
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+
+  MarkerHandle handle = doInsert( boost::make_shared<visualization_msgs::InteractiveMarker>( int_marker ) );
+  doSetCallback( findSlot( handle ), feedback_cb, feedback_type );
+  return handle;
+}
+
+InteractiveMarkerServer::MarkerHandle InteractiveMarkerServer::insert( visualization_msgs::InteractiveMarker &&int_marker )
+{
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+
+  return doInsert( boost::make_shared<visualization_msgs::InteractiveMarker>( std::move( int_marker ) ) );
+}
+
+InteractiveMarkerServer::MarkerHandle InteractiveMarkerServer::insert( visualization_msgs::InteractiveMarker &&int_marker,
+    FeedbackCallback feedback_cb, uint8_t feedback_type)
+{
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+
+  MarkerHandle handle = doInsert( boost::make_shared<visualization_msgs::InteractiveMarker>( std::move( int_marker ) ) );
+  doSetCallback( findSlot( handle ), feedback_cb, feedback_type );
+  return handle;
+}
+
+InteractiveMarkerServer::MarkerHandle InteractiveMarkerServer::insert( const visualization_msgs::InteractiveMarker &int_marker,
+    const ros::Duration &lifetime )
+{
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+
+  MarkerHandle handle = doInsert( boost::make_shared<visualization_msgs::InteractiveMarker>( int_marker ) );
+  setLifetime( findSlot( handle ), lifetime );
+  return handle;
+}
+
+InteractiveMarkerServer::MarkerHandle InteractiveMarkerServer::insert( visualization_msgs::InteractiveMarker &&int_marker,
+    const ros::Duration &lifetime )
+{
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+
+  MarkerHandle handle = doInsert( boost::make_shared<visualization_msgs::InteractiveMarker>( std::move( int_marker ) ) );
+  setLifetime( findSlot( handle ), lifetime );
+  return handle;
+}
+
+InteractiveMarkerServer::MarkerHandle InteractiveMarkerServer::doInsert( const visualization_msgs::InteractiveMarkerConstPtr &int_marker )
+{
+  uint32_t slot_index = findSlot( int_marker->name );
+  if ( slot_index == NO_SLOT )
+  {
+    slot_index = acquireSlot( int_marker->name );
+  }
+
+  UpdateContext &update_context = pendingUpdate( slot_index );
+  update_context.update_type = UpdateContext::FULL_UPDATE;
+  update_context.marker.int_marker = int_marker;
+  update_context.marker.header = int_marker->header;
+  update_context.marker.pose = int_marker->pose;
+  update_context.content_hash = suppress_redundant_updates_ ? hashMarkerContents( *int_marker, hash_buffer_ ) : 0;
+
+  // a lifetime has to be given again
+  slots_[slot_index].expiry_tick = 0;
+
+  updateSpatialIndex( slot_index );
+  return makeHandle( slot_index );
+}
+
+void InteractiveMarkerServer::setLifetime( uint32_t slot_index, const ros::Duration &lifetime )
+{
+  if ( lifetime <= ros::Duration() )
+  {
+    return;
+  }
+
+  // Timers can't be cancelled. If the marker is gone or has got a
+  // different lifetime when this one expires, it is just ignored.
+  uint64_t deadline = getExpiryTick() + std::max<uint64_t>( lifetime.toNSec() / EXPIRY_TICK_NSEC, 1 );
+  slots_[slot_index].expiry_tick = deadline;
+  expiry_wheel_.schedule( deadline, makeHandle( slot_index ) );
+}
+
+void InteractiveMarkerServer::setSpatialIndex( double cell_size )
+{
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+
+  if ( cell_size <= 0 )
+  {
+    spatial_index_.reset();
+    return;
+  }
+
+  spatial_index_.reset( new SpatialGrid( cell_size ) );
+  for ( uint32_t slot_index = 0; slot_index < slots_.size(); slot_index++ )
+  {
+    if ( slots_[slot_index].in_use )
+    {
+      updateSpatialIndex( slot_index );
+    }
+  }
+}
+
+void InteractiveMarkerServer::updateSpatialIndex( uint32_t slot_index )
+{
+  if ( !spatial_index_ )
+  {
+    return;
+  }
+
+  SharedMarker marker;
+  if ( getCurrent( slot_index, marker ) )
+  {
+    const geometry_msgs::Point &position = marker.pose.position;
+    spatial_index_->update( slot_index, marker.header.frame_id, position.x, position.y, position.z );
+  }
+  else
+  {
+    spatial_index_->remove( slot_index );
+  }
+}
+
+std::size_t InteractiveMarkerServer::queryBox( const std::string &frame_id, const geometry_msgs::Point &min,
+    const geometry_msgs::Point &max, std::vector<std::string> &names ) const
+{
+  ReadLock lock( mutex_ );
+
+  std::vector<uint32_t> slot_indices;
+  findInBox( frame_id, min, max, slot_indices );
+  for ( std::size_t i = 0; i < slot_indices.size(); i++ )
+  {
+    names.push_back( slots_[slot_indices[i]].name );
+  }
+  return slot_indices.size();
+}
+
+std::size_t InteractiveMarkerServer::queryRadius( const std::string &frame_id, const geometry_msgs::Point &center,
+    double radius, std::vector<std::string> &names ) const
+{
+  ReadLock lock( mutex_ );
+
+  std::vector<uint32_t> slot_indices;
+  findInRadius( frame_id, center, radius, slot_indices );
+  for ( std::size_t i = 0; i < slot_indices.size(); i++ )
+  {
+    names.push_back( slots_[slot_indices[i]].name );
+  }
+  return slot_indices.size();
+}
+
+std::size_t InteractiveMarkerServer::eraseInBox( const std::string &frame_id, const geometry_msgs::Point &min,
+    const geometry_msgs::Point &max )
+{
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+
+  std::vector<uint32_t> slot_indices;
+  findInBox( frame_id, min, max, slot_indices );
+  for ( std::size_t i = 0; i < slot_indices.size(); i++ )
+  {
+    doErase( slot_indices[i] );
+  }
+  return slot_indices.size();
+}
+
+void InteractiveMarkerServer::findInBox( const std::string &frame_id, const geometry_msgs::Point &min,
+    const geometry_msgs::Point &max, std::vector<uint32_t> &slot_indices ) const
+{
+  if ( spatial_index_ )
+  {
+    spatial_index_->queryBox( frame_id, min.x, min.y, min.z, max.x, max.y, max.z, slot_indices );
+    return;
+  }
+
+  SharedMarker marker;
+  for ( uint32_t slot_index = 0; slot_index < slots_.size(); slot_index++ )
+  {
+    if ( !slots_[slot_index].in_use || !getCurrent( slot_index, marker ) || marker.header.frame_id != frame_id )
+    {
+      continue;
+    }
+    const geometry_msgs::Point &p = marker.pose.position;
+    if ( p.x >= min.x && p.x <= max.x && p.y >= min.y && p.y <= max.y && p.z >= min.z && p.z <= max.z )
+    {
+      slot_indices.push_back( slot_index );
+    }
+  }
+}
+
+void InteractiveMarkerServer::findInRadius( const std::string &frame_id, const geometry_msgs::Point &center,
+    double radius, std::vector<uint32_t> &slot_indices ) const
+{
+  if ( spatial_index_ )
+  {
+    spatial_index_->queryRadius( frame_id, center.x, center.y, center.z, radius, slot_indices );
+    return;
+  }
+
+  SharedMarker marker;
+  for ( uint32_t slot_index = 0; slot_index < slots_.size(); slot_index++ )
+  {
+    if ( !slots_[slot_index].in_use || !getCurrent( slot_index, marker ) || marker.header.frame_id != frame_id )
+    {
+      continue;
+    }
+    double dx = marker.pose.position.x - center.x;
+    double dy = marker.pose.position.y - center.y;
+    double dz = marker.pose.position.z - center.z;
+    if ( dx*dx + dy*dy + dz*dz <= radius * radius )
+    {
+      slot_indices.push_back( slot_index );
+    }
+  }
+}
+
+uint64_t InteractiveMarkerServer::getExpiryTick()
+{
+  uint64_t now = ros::Time::now().toNSec() / EXPIRY_TICK_NSEC;
+  uint64_t then = expiry_wheel_.now();
+  if ( now >= then )
+  {
+    return now;
+  }
+
+  // Simulated time has been restarted, or a bag file is played in a loop. The old
+  // deadlines might never come again, so keep what was left of each lifetime.
+  ROS_DEBUG( "Time has jumped back by %f s, rescheduling marker lifetimes.", ( then - now ) * EXPIRY_TICK_NSEC * 1e-9 );
+  expiry_wheel_.clear( now );
+  for ( uint32_t slot_index = 0; slot_index < slots_.size(); slot_index++ )
+  {
+    MarkerSlot &slot = slots_[slot_index];
+    if ( slot.expiry_tick == 0 )
+    {
+      continue;
+    }
+    slot.expiry_tick = now + ( slot.expiry_tick > then ? slot.expiry_tick - then : 1 );
+    expiry_wheel_.schedule( slot.expiry_tick, makeHandle( slot_index ) );
+  }
+  return now;
+}
+
+void InteractiveMarkerServer::expireMarkers()
+{
+  uint64_t now = getExpiryTick();
+  expiry_wheel_.advance( now, expired_handles_ );
+
+  for ( std::size_t i = 0; i < expired_handles_.size(); i++ )
+  {
+    uint32_t slot_index = findSlot( expired_handles_[i] );
+    if ( slot_index == NO_SLOT )
+    {
+      continue;
+    }
+
+    MarkerSlot &slot = slots_[slot_index];
+    if ( slot.expiry_tick != 0 && slot.expiry_tick <= now )
+    {
+      slot.expiry_tick = 0;
+      if ( isPresent( slot ) )
+      {
+        ROS_DEBUG( "Marker '%s' has expired.", slot.name.c_str() );
+        doErase( slot_index );
+      }
+    }
+  }
+  expired_handles_.clear();
+}
+
+bool InteractiveMarkerServer::get( const std::string &name, visualization_msgs::InteractiveMarker &int_marker ) const
+{
+  ReadLock lock( mutex_ );
+
+  uint32_t slot_index = findSlot( name );
+  SharedMarker marker;
+  if ( slot_index == NO_SLOT || !getCurrent( slot_index, marker ) )
+  {
+    return false;
+  }
+
+  marker.copyTo( int_marker );
+  return true;
+}
+
+visualization_msgs::InteractiveMarkerConstPtr InteractiveMarkerServer::getShared( const std::string &name ) const
+{
+  ReadLock lock( mutex_ );
+
+  uint32_t slot_index = findSlot( name );
+  SharedMarker marker;
+  if ( slot_index == NO_SLOT || !getCurrent( slot_index, marker ) )
+  {
+    return visualization_msgs::InteractiveMarkerConstPtr();
+  }
+
+  return marker.toMessage();
+}
+
+bool InteractiveMarkerServer::getCurrent( uint32_t slot_index, SharedMarker &marker ) const
+{
+  const MarkerSlot &slot = slots_[slot_index];
+
+  if ( !slot.pending )
+  {
+    if ( !isLive( slot ) )
+    {
+      return false;
+    }
+
+    marker = committedMarker( slot );
+    PoseStaging &shard = poseShard( slot_index );
+    boost::mutex::scoped_lock shard_lock( shard.mutex );
+    if ( slot.staged_index != NO_SLOT )
+    {
+      marker.pose = shard.poses[slot.staged_index];
+      uint32_t header_index = shard.header_indices[slot.staged_index];
+      if ( header_index != NO_SLOT )
+      {
+        marker.header = shard.headers[header_index];
+      }
+    }
+    return true;
+  }
+
+  // if there's an update pending, we'll have to account for that
+  switch ( slot.update_context.update_type )
+  {
+    case UpdateContext::ERASE:
+      return false;
+
+    case UpdateContext::POSE_UPDATE:
+    {
+      if ( !slot.committed )
+      {
+        return false;
+      }
+      marker = committedMarker( slot );
+      marker.header = slot.update_context.marker.header;
+      marker.pose = slot.update_context.marker.pose;
+      return true;
+    }
+
+    case UpdateContext::FULL_UPDATE:
+      marker = slot.update_context.marker;
+      return true;
+  }
+
+  return false;
+}
+
+InteractiveMarkerServer::MarkerHandle InteractiveMarkerServer::getHandle( const std::string &name ) const
+{
+  ReadLock lock( mutex_ );
+
+  uint32_t slot_index = findSlot( name );
+  if ( slot_index == NO_SLOT )
+  {
+    return INVALID_HANDLE;
+  }
+  return makeHandle( slot_index );
+}
+
+void InteractiveMarkerServer::publishInit()
+{
+  if ( publisher_ )
+  {
+    // init_msg_ keeps changing, so the publisher needs a snapshot.
+    // This only copies references to the marker contents.
+    boost::shared_ptr<SharedMarkerInit> init = boost::make_shared<SharedMarkerInit>( init_msg_ );
+    publisher_->post( std::string(), boost::bind( &InteractiveMarkerServer::sendInitJob, this, init ) );
+  }
+  else
+  {
+    sendInit( init_msg_ );
+  }
+  publishTileInits();
+
+  init_dirty_ = false;
+  last_init_publish_ = ros::WallTime::now();
+}
+
+void InteractiveMarkerServer::publishInitIfDue()
+{
+  if ( !init_dirty_ )
+  {
+    return;
+  }
+
+  ros::WallTime now = ros::WallTime::now();
+  if ( !lazy_init_ || now < init_demand_until_ )
+  {
+    publishInit();
+  }
+  else if ( !min_init_period_.isZero() && now - last_init_publish_ >= min_init_period_ )
+  {
+    publishInit();
+  }
+}
+
+void InteractiveMarkerServer::initSubscriberConnected( const ros::SingleSubscriberPublisher& )
+{
+  WriteLock lock( mutex_ );
+
+  if ( !lazy_init_ )
+  {
+    return;
+  }
+
+  init_demand_until_ = ros::WallTime::now() + ros::WallDuration( 2.0 );
+
+  // if the latched message is still up to date, the new client already got it
+  if ( init_dirty_ )
+  {
+    ROS_DEBUG( "New init subscriber, publishing the current state." );
+    publishInit();
+  }
+}
+
+void InteractiveMarkerServer::setLazyInitPublishing( bool enable, double max_rate )
+{
+  WriteLock lock( mutex_ );
+
+  lazy_init_ = enable;
+  min_init_period_ = max_rate > 0 ? ros::WallDuration( 1.0 / max_rate ) : ros::WallDuration();
+
+  // bring the latched message up to date when switching back
+  publishInitIfDue();
+}
+
+
+SharedMarker& InteractiveMarkerServer::committedMarker( const MarkerSlot& slot )
+{
+  return init_msg_.markers[ slot.marker_context.init_index ];
+}
+
+const SharedMarker& InteractiveMarkerServer::committedMarker( const MarkerSlot& slot ) const
+{
+  return init_msg_.markers[ slot.marker_context.init_index ];
+}
+
+void InteractiveMarkerServer::eraseCommitted( uint32_t slot_index )
+{
+  MarkerSlot &slot = slots_[slot_index];
+  std::size_t index = slot.marker_context.init_index;
+  std::size_t last_index = init_msg_.markers.size() - 1;
+
+  // fill the gap with the last marker, so we don't have to shift the others
+  if ( index != last_index )
+  {
+    std::swap( init_msg_.markers[index], init_msg_.markers[last_index] );
+    init_slots_[index] = init_slots_[last_index];
+    slots_[init_slots_[index]].marker_context.init_index = index;
+  }
+
+  init_msg_.markers.pop_back();
+  init_slots_.pop_back();
+  slot.committed = false;
+  slot.marker_context = MarkerContext();
+}
+
+uint32_t InteractiveMarkerServer::findSlot( const std::string &name ) const
+{
+  boost::unordered_map<std::string, uint32_t>::const_iterator it = slot_index_.find( name );
+  if ( it == slot_index_.end() )
+  {
+    return NO_SLOT;
+  }
+  return it->second;
+}
+
+uint32_t InteractiveMarkerServer::findSlot( MarkerHandle handle ) const
+{
+  uint32_t slot_index = handle & 0xffffffff;
+  uint32_t version = handle >> 32;
+  if ( slot_index >= slots_.size() || !slots_[slot_index].in_use || slots_[slot_index].version != version )
+  {
+    return NO_SLOT;
+  }
+  return slot_index;
+}
+
+uint32_t InteractiveMarkerServer::acquireSlot( const std::string &name )
+{
+  uint32_t slot_index;
+  if ( free_slots_.empty() )
+  {
+    slot_index = slots_.size();
+    slots_.push_back( MarkerSlot() );
+    slots_.back().version = 1;
+  }
+  else
+  {
+    slot_index = free_slots_.back();
+    free_slots_.pop_back();
+  }
+
+  MarkerSlot &slot = slots_[slot_index];
+  slot.name = name;
+  slot.in_use = true;
+  slot.committed = false;
+  slot.pending = false;
+  slot.deferred = false;
+  slot.staged_index = NO_SLOT;
+  slot.expiry_tick = 0;
+  slot_index_[name] = slot_index;
+  return slot_index;
+}
+
+void InteractiveMarkerServer::releaseSlotIfUnused( uint32_t slot_index )
+{
+  MarkerSlot &slot = slots_[slot_index];
+  if ( slot.committed || slot.pending )
+  {
+    return;
+  }
+
+  if ( spatial_index_ )
+  {
+    spatial_index_->remove( slot_index );
+  }
+  slot_index_.erase( slot.name );
+  slot.name.clear();
+  slot.in_use = false;
+  // zero is never used, so INVALID_HANDLE can't match any slot
+  if ( ++slot.version == 0 )
+  {
+    slot.version = 1;
+  }
+  free_slots_.push_back( slot_index );
+}
+
+InteractiveMarkerServer::MarkerHandle InteractiveMarkerServer::makeHandle( uint32_t slot_index ) const
+{
+  return ( MarkerHandle( slots_[slot_index].version ) << 32 ) | slot_index;
+}
+
+InteractiveMarkerServer::UpdateContext& InteractiveMarkerServer::pendingUpdate( uint32_t slot_index )
+{
+  MarkerSlot &slot = slots_[slot_index];
+  if ( !slot.pending )
+  {
+    slot.pending = true;
+    dirty_slots_.push_back( slot_index );
+  }
+  else if ( slot.deferred )
+  {
+    // it has been changed again, so it has to wait for the next applyChanges()
+    slot.deferred = false;
+    dirty_slots_.push_back( slot_index );
+  }
+  return slot.update_context;
+}
+
+void InteractiveMarkerServer::processFeedback( const FeedbackConstPtr& feedback )
+{
+  WriteLock lock( mutex_ );
+  drainUpdateQueue();
+
+  uint32_t slot_index = findSlot( feedback->marker_name );
+
+  // ignore feedback for non-existing markers
+  if ( slot_index == NO_SLOT || !isLive( slots_[slot_index] ) )
+  {
+    return;
+  }
+
+  MarkerContext &marker_context = slots_[slot_index].marker_context;
+
+  // if two callers try to modify the same marker, reject (timeout= 1 sec)
+  if ( marker_context.last_client_id != feedback->client_id &&
+      (ros::Time::now() - marker_context.last_feedback).toSec() < 1.0 )
+  {
+    ROS_DEBUG( "Rejecting feedback for %s: conflicting feedback from separate clients.", feedback->marker_name.c_str() );
+    return;
+  }
+
+  marker_context.last_feedback = ros::Time::now();
+  marker_context.last_client_id = feedback->client_id;
+
+  if ( feedback->event_type == visualization_msgs::InteractiveMarkerFeedback::POSE_UPDATE )
+  {
+    const std_msgs::Header &header = committedMarker( slots_[slot_index] ).header;
+    // keep the old header if it has no time stamp
+    bool keep_header = header.stamp == ros::Time(0);
+    if ( !stagePose( slot_index, feedback->pose, keep_header ? std_msgs::Header() : feedback->header ) )
+    {
+      schedulePoseUpdate( slot_index, feedback->pose, keep_header ? header : feedback->header );
+    }
+    updateSpatialIndex( slot_index );
+  }
+
+  // call feedback handler. Work on a copy, since the callback might
+  // insert new markers, which can move the slot the original lives in.
+  FeedbackCallback feedback_cb;
+  boost::unordered_map<uint8_t,FeedbackCallback>::iterator feedback_cb_it = marker_context.feedback_cbs.find( feedback->event_type );
+  if ( feedback_cb_it != marker_context.feedback_cbs.end() && feedback_cb_it->second )
+  {
+    // call type-specific callback
+    feedback_cb = feedback_cb_it->second;
+  }
+  else if ( marker_context.default_feedback_cb )
+  {
+    // call default callback
+    feedback_cb = marker_context.default_feedback_cb;
+  }
+
+  if ( !feedback_cb )
+  {
+    return;
+  }
+
+  if ( feedback_executor_ )
+  {
+    // keep the executor alive in case it is replaced while we wait for it
+    boost::shared_ptr<KeyedThreadPool> executor = feedback_executor_;
+    bool replaceable = coalesce_pose_updates_ &&
+        feedback->event_type == visualization_msgs::InteractiveMarkerFeedback::POSE_UPDATE;
+    lock.unlock();
+    executor->post( feedback->marker_name, boost::bind( feedback_cb, feedback ), replaceable );
+  }
+  else
+  {
+    // the lock is not recursive, and the callback will most likely use the server
+    lock.unlock();
+    feedback_cb( feedback );
+  }
+}
+
+void InteractiveMarkerServer::setMaxBandwidth( double bytes_per_second )
+{
+  WriteLock lock( mutex_ );
+  max_bandwidth_ = bytes_per_second;
+  bandwidth_tokens_ = bytes_per_second;
+  last_bandwidth_refill_ = ros::WallTime::now();
+
+  // without a limit, everything can go out right away
+  if ( max_bandwidth_ <= 0 )
+  {
+    flush( false );
+  }
+}
+
+void InteractiveMarkerServer::setMaxUpdateSize( uint32_t max_bytes )
+{
+  WriteLock lock( mutex_ );
+  max_update_size_ = max_bytes;
+}
+
+void InteractiveMarkerServer::setSuppressRedundantUpdates( bool enable )
+{
+  WriteLock lock( mutex_ );
+  suppress_redundant_updates_ = enable;
+}
+
+void InteractiveMarkerServer::setFeedbackExecutor( unsigned int num_threads, std::size_t max_queued )
+{
+  boost::shared_ptr<KeyedThreadPool> old_executor;
+  {
+    WriteLock lock( mutex_ );
+    old_executor.swap( feedback_executor_ );
+    if ( num_threads > 0 )
+    {
+      feedback_executor_.reset( new KeyedThreadPool( num_threads, max_queued ) );
+    }
+    else
+    {
+      // there is nothing left to coalesce in
+      coalesce_pose_updates_ = false;
+    }
+  }
+  // waits for the queued callbacks, which might need the lock
+  old_executor.reset();
+}
+
+void InteractiveMarkerServer::setCoalescePoseUpdates( bool enable )
+{
+  WriteLock lock( mutex_ );
+
+  coalesce_pose_updates_ = enable;
+  if ( enable && !feedback_executor_ )
+  {
+    // same queue limit as the default of setFeedbackExecutor()
+    feedback_executor_.reset( new KeyedThreadPool( 1, 1000 ) );
+  }
+}
+
+void InteractiveMarkerServer::setLockFreeUpdates( bool enable )
+{
+  WriteLock lock( mutex_ );
+  lock_free_updates_ = enable;
+  drainUpdateQueue();
+}
+
+void InteractiveMarkerServer::setAsyncPublishing( bool enable )
+{
+  WriteLock lock( mutex_ );
+  if ( enable && !publisher_ )
+  {
+    publisher_.reset( new KeyedThreadPool( 1, 0 ) );
+  }
+  else if ( !enable )
+  {
+    // Wait for the queued messages with the lock held, so that nothing is
+    // sent directly before they are out. Sending never needs the lock.
+    publisher_.reset();
+  }
+}
+
+void InteractiveMarkerServer::setSeparatePoseChannel( bool enable )
+{
+  WriteLock lock( mutex_ );
+  if ( enable == separate_pose_channel_ )
+  {
+    return;
+  }
+
+  // the background publisher is the only other user of the publishers
+  if ( publisher_ )
+  {
+    publisher_->waitIdle();
+  }
+
+  if ( enable )
+  {
+    pose_pub_ = node_handle_.advertise<visualization_msgs::InteractiveMarkerUpdate>( topic_ns_ + "/update_poses", 100 );
+  }
+  else
+  {
+    pose_pub_.shutdown();
+  }
+  separate_pose_channel_ = enable;
+}
+
+void InteractiveMarkerServer::waitForPublishing()
+{
+  boost::shared_ptr<KeyedThreadPool> publisher;
+  {
+    ReadLock lock( mutex_ );
+    publisher = publisher_;
+  }
+  if ( publisher )
+  {
+    publisher->waitIdle();
+  }
+}
+
+void InteractiveMarkerServer::setTileSize( double tile_size, double empty_tile_timeout )
+{
+  WriteLock lock( mutex_ );
+
+  if ( tile_size <= 0 )
+  {
+    tile_publisher_.reset();
+    return;
+  }
+  if ( tile_publisher_ && tile_publisher_->getTileSize() == tile_size &&
+      tile_publisher_->getEmptyTileTimeout() == std::max( empty_tile_timeout, 0.0 ) )
+  {
+    return;
+  }
+
+  // Start the tiles with the state the clients have seen so far. Changing the
+  // tile size drops the old tiles, their clients notice that the publishers are gone.
+  // New clients of a tile open the same demand window as those of the server.
+  tile_publisher_.reset( new TilePublisher( node_handle_, topic_ns_, server_id_, tile_size,
+      boost::bind( &InteractiveMarkerServer::initSubscriberConnected, this, _1 ), empty_tile_timeout ) );
+
+  SharedMarkerUpdate update;
+  update.type = visualization_msgs::InteractiveMarkerUpdate::UPDATE;
+  update.markers = init_msg_.markers;
+  publishTiles( tile_publisher_->route( update ) );
+  publishTileInits();
+}
+
+InteractiveMarkerServer::FeedbackExecutorStats InteractiveMarkerServer::getFeedbackExecutorStats() const
+{
+  ReadLock lock( mutex_ );
+  if ( !feedback_executor_ )
+  {
+    return FeedbackExecutorStats();
+  }
+  return feedback_executor_->getStats();
+}
+
+
+void InteractiveMarkerServer::keepAlive()
+{
+  WriteLock lock( mutex_ );
+
+  expireMarkers();
+
+  // send the updates that had to wait for bandwidth
+  flush( false );
+  publishInitIfDue();
+
+  if ( publisher_ )
+  {
+    publisher_->post( std::string(), boost::bind( &InteractiveMarkerServer::sendKeepAlive, this ) );
+    if ( tile_publisher_ )
+    {
+      publisher_->post( std::string(), boost::bind( &TilePublisher::sendKeepAlive, tile_publisher_ ) );
+    }
+  }
+  else
+  {
+    sendKeepAlive();
+    if ( tile_publisher_ )
+    {
+      tile_publisher_->sendKeepAlive();
+    }
+  }
+}
+
+
+void InteractiveMarkerServer::publishUpdate( SharedMarkerUpdate &update )
+{
+  // this has to happen before the update is handed over
+  boost::shared_ptr<TilePublisher::Batch> tile_batch;
+  if ( tile_publisher_ )
+  {
+    tile_batch = tile_publisher_->route( update );
+  }
+
+  if ( publisher_ )
+  {
+    boost::shared_ptr<SharedMarkerUpdate> job = boost::make_shared<SharedMarkerUpdate>( std::move( update ) );
+    publisher_->post( std::string(), boost::bind( &InteractiveMarkerServer::sendUpdateJob, this, job, max_update_size_ ) );
+  }
+  else
+  {
+    sendUpdate( update, max_update_size_ );
+  }
+
+  if ( tile_batch )
+  {
+    publishTiles( tile_batch );
+  }
+}
+
+void InteractiveMarkerServer::publishTiles( const boost::shared_ptr<TilePublisher::Batch> &batch )
+{
+  if ( batch->empty() )
+  {
+    return;
+  }
+
+  if ( publisher_ )
+  {
+    publisher_->post( std::string(), boost::bind( &TilePublisher::send, tile_publisher_, batch ) );
+  }
+  else
+  {
+    tile_publisher_->send( batch );
+  }
+}
+
+void InteractiveMarkerServer::publishTileInits()
+{
+  if ( !tile_publisher_ )
+  {
+    return;
+  }
+
+  if ( publisher_ )
+  {
+    boost::shared_ptr<TilePublisher::InitBatch> inits = tile_publisher_->takeChangedInits();
+    if ( !inits->empty() )
+    {
+      publisher_->post( std::string(), boost::bind( &TilePublisher::sendInits, tile_publisher_, inits ) );
+    }
+  }
+  else
+  {
+    tile_publisher_->sendChangedInits();
+  }
+}
+
+void InteractiveMarkerServer::send( SharedMarkerUpdate &update, ros::Publisher &publisher )
+{
+  update.server_id = server_id_;
+  update.seq_num = seq_num_;
+  publisher.publish( update );
+}
+
+void InteractiveMarkerServer::sendKeepAlive()
+{
+  SharedMarkerUpdate empty_update;
+  empty_update.type = visualization_msgs::InteractiveMarkerUpdate::KEEP_ALIVE;
+  send( empty_update, update_pub_ );
+}
+
+void InteractiveMarkerServer::sendInit( SharedMarkerInit &init )
+{
+  init.seq_num = seq_num_;
+  init_pub_.publish( init );
+}
+
+void InteractiveMarkerServer::sendInitJob( const boost::shared_ptr<SharedMarkerInit> &init )
+{
+  sendInit( *init );
+}
+
+void InteractiveMarkerServer::sendUpdateJob( const boost::shared_ptr<SharedMarkerUpdate> &update, uint32_t max_update_size )
+{
+  sendUpdate( *update, max_update_size );
+}
+
+void InteractiveMarkerServer::sendUpdate( SharedMarkerUpdate &update, uint32_t max_update_size )
+{
+  if ( !separate_pose_channel_ || update.poses.empty() )
+  {
+    sendUpdate( update, max_update_size, update_pub_ );
+    return;
+  }
+
+  // A name never appears twice in one update, so the order of the two parts does not matter.
+  SharedMarkerUpdate pose_update;
+  pose_update.type = update.type;
+  pose_update.poses.swap( update.poses );
+
+  if ( !update.markers.empty() || !update.erases.empty() )
+  {
+    sendUpdate( update, max_update_size, update_pub_ );
+  }
+  sendUpdate( pose_update, max_update_size, pose_pub_ );
+}
+
+void InteractiveMarkerServer::sendUpdate( SharedMarkerUpdate &update, uint32_t max_update_size, ros::Publisher &publisher )
+{
+  namespace ser = ros::serialization;
+
+  update.server_id = server_id_;
+  if ( max_update_size == 0 || ser::serializationLength( update ) <= max_update_size )
+  {
+    seq_num_++;
+    send( update, publisher );
+    return;
+  }
+
+  // Each item goes into exactly one chunk. A name never appears twice in one update,
+  // so the clients end up in the same state no matter how it is split.
+  SharedMarkerUpdate chunk;
+  chunk.type = update.type;
+  chunk.server_id = server_id_;
+  const uint32_t empty_size = ser::serializationLength( chunk );
+  uint32_t size = empty_size;
+  unsigned int num_chunks = 0;
+
+  for ( std::size_t i = 0; i < update.erases.size(); i++ )
+  {
+    uint32_t item_size = ser::serializationLength( update.erases[i] );
+    if ( size + item_size > max_update_size && size > empty_size )
+    {
+      sendChunk( chunk, publisher );
+      num_chunks++;
+      size = empty_size;
+    }
+    chunk.erases.push_back( std::move( update.erases[i] ) );
+    size += item_size;
+  }
+
+  for ( std::size_t i = 0; i < update.poses.size(); i++ )
+  {
+    uint32_t item_size = ser::serializationLength( update.poses[i] );
+    if ( size + item_size > max_update_size && size > empty_size )
+    {
+      sendChunk( chunk, publisher );
+      num_chunks++;
+      size = empty_size;
+    }
+    chunk.poses.push_back( std::move( update.poses[i] ) );
+    size += item_size;
+  }
+
+  for ( std::size_t i = 0; i < update.markers.size(); i++ )
+  {
+    uint32_t item_size = ser::serializationLength( update.markers[i] );
+    if ( size + item_size > max_update_size && size > empty_size )
+    {
+      sendChunk( chunk, publisher );
+      num_chunks++;
+      size = empty_size;
+    }
+    chunk.markers.push_back( std::move( update.markers[i] ) );
+    size += item_size;
+  }
+
+  sendChunk( chunk, publisher );
+  num_chunks++;
+  ROS_DEBUG( "Split update into %u messages of at most %u bytes.", num_chunks, max_update_size );
+}
+
+void InteractiveMarkerServer::sendChunk( SharedMarkerUpdate &chunk, ros::Publisher &publisher )
+{
+  seq_num_++;
+  send( chunk, publisher );
+  chunk.markers.clear();
+  chunk.poses.clear();
+  chunk.erases.clear();
+}
+
+
+void InteractiveMarkerServer::schedulePoseUpdate( uint32_t slot_index, const geometry_msgs::Pose &pose, const std_msgs::Header &header )
+{
+  MarkerSlot &slot = slots_[slot_index];
+  if ( !slot.pending )
+  {
+    pendingUpdate( slot_index ).update_type = UpdateContext::POSE_UPDATE;
+  }
+  else if ( slot.deferred )
+  {
+    pendingUpdate( slot_index );
+  }
+  else if ( slot.update_context.update_type != UpdateContext::FULL_UPDATE )
+  {
+    slot.update_context.update_type = UpdateContext::POSE_UPDATE;
+  }
+
+  slot.update_context.marker.pose = pose;
+  slot.update_context.marker.header = header;
+  ROS_DEBUG( "Marker '%s' is now at %f, %f, %f", slot.name.c_str(), pose.position.x, pose.position.y, pose.position.z );
+}
+
+bool InteractiveMarkerServer::stagePose( uint32_t slot_index, const geometry_msgs::Pose &pose, const std_msgs::Header &header )
+{
+  // these only change with the exclusive lock held
+  MarkerSlot &slot = slots_[slot_index];
+  if ( !isLive( slot ) || slot.pending )
+  {
+    return false;
+  }
+
+  // staged_index belongs to the shard
+  PoseStaging &shard = poseShard( slot_index );
+  boost::mutex::scoped_lock shard_lock( shard.mutex );
+  uint32_t header_index = shard.addHeader( header );
+  if ( slot.staged_index == NO_SLOT )
+  {
+    slot.staged_index = shard.slots.size();
+    shard.slots.push_back( slot_index );
+    shard.poses.push_back( pose );
+    shard.header_indices.push_back( header_index );
+  }
+  else
+  {
+    shard.poses[slot.staged_index] = pose;
+    shard.header_indices[slot.staged_index] = header_index;
+  }
+  return true;
+}
+
+void InteractiveMarkerServer::flushStagedPoses( SharedMarkerUpdate &update )
+{
+  // nobody can stage poses while we hold the exclusive lock,
+  // so the shards don't need to be locked
+  for ( std::size_t shard_index = 0; shard_index < NUM_POSE_SHARDS; shard_index++ )
+  {
+    PoseStaging &shard = staged_poses_[shard_index];
+    for ( std::size_t i = 0; i < shard.slots.size(); i++ )
+    {
+      MarkerSlot &slot = slots_[ shard.slots[i] ];
+      slot.staged_index = NO_SLOT;
+
+      // a later insert() or erase() supersedes the staged pose
+      if ( slot.pending || !slot.committed )
+      {
+        continue;
+      }
+
+      uint32_t header_index = shard.header_indices[i];
+      const std_msgs::Header &header = header_index != NO_SLOT ?
+          shard.headers[header_index] : committedMarker( slot ).header;
+      commitPose( shard.slots[i], header, shard.poses[i], update );
+    }
+
+    shard.clear();
+  }
+}
+
+bool InteractiveMarkerServer::hasStagedPoses() const
+{
+  for ( std::size_t shard_index = 0; shard_index < NUM_POSE_SHARDS; shard_index++ )
+  {
+    if ( !staged_poses_[shard_index].empty() )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::size_t InteractiveMarkerServer::numStagedPoses() const
+{
+  std::size_t num_poses = 0;
+  for ( std::size_t shard_index = 0; shard_index < NUM_POSE_SHARDS; shard_index++ )
+  {
+    num_poses += staged_poses_[shard_index].slots.size();
+  }
+  return num_poses;
+}
+
+void InteractiveMarkerServer::PoseStaging::clear()
+{
+  // keep the capacity, the next cycle will most likely need the same
+  slots.clear();
+  poses.clear();
+  header_indices.clear();
+  headers.clear();
+}
+
+uint32_t InteractiveMarkerServer::PoseStaging::addHeader( const std_msgs::Header &header )
+{
+  if ( header.frame_id.empty() )
+  {
+    return NO_SLOT;
+  }
+
+  // consecutive calls usually share their header
+  if ( !headers.empty() && isSameHeader( headers.back(), header ) )
   {
-    update_it->second.update_type = UpdateContext::POSE_UPDATE;
+    return headers.size() - 1;
   }
 
-  update_it->second.int_marker.pose = pose;
-  update_it->second.int_marker.header = header;
-  ROS_DEBUG( "Marker '%s' is now at %f, %f, %f", update_it->first.c_str(), pose.position.x, pose.position.y, pose.position.z );
+  headers.push_back( header );
+  return headers.size() - 1;
 }
 
 
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "interactive_markers/detail/keyed_thread_pool.h"
+
+#include <ros/console.h>
+
+#include <boost/bind.hpp>
+
+namespace interactive_markers
+{
+
+KeyedThreadPool::KeyedThreadPool( unsigned int num_threads, std::size_t max_queued ) :
+    num_running_(0),
+    max_queued_(max_queued),
+    shutdown_(false)
+{
+  if ( num_threads == 0 )
+  {
+    num_threads = 1;
+  }
+
+  for ( unsigned int i = 0; i < num_threads; i++ )
+  {
+    threads_.create_thread( boost::bind( &KeyedThreadPool::workerThread, this ) );
+  }
+}
+
+KeyedThreadPool::~KeyedThreadPool()
+{
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    shutdown_ = true;
+  }
+  work_cond_.notify_all();
+  threads_.join_all();
+}
+
+void KeyedThreadPool::post( const std::string &key, const Task &task, bool replaceable )
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+
+  QueuedTask queued_task;
+  queued_task.task = task;
+  queued_task.replaceable = replaceable;
+
+  // tasks in the queue are all waiting, the running one has already been removed
+  M_TaskQueue::iterator it = queues_.find( key );
+  if ( replaceable && it != queues_.end() && !it->second.empty() && it->second.back().replaceable )
+  {
+    stats_.posted++;
+    stats_.coalesced++;
+    it->second.back() = queued_task;
+    return;
+  }
+
+  if ( max_queued_ != 0 && stats_.queued >= max_queued_ )
+  {
+    stats_.blocked_posts++;
+    while ( stats_.queued >= max_queued_ )
+    {
+      space_cond_.wait( lock );
+    }
+  }
+
+  stats_.posted++;
+  stats_.queued++;
+  if ( stats_.queued > stats_.max_queued )
+  {
+    stats_.max_queued = stats_.queued;
+  }
+
+  // the map might have changed while we were waiting
+  it = queues_.find( key );
+  if ( it != queues_.end() )
+  {
+    // a worker will pick this up once it is done with the previous tasks
+    it->second.push_back( queued_task );
+    return;
+  }
+
+  queues_[key].push_back( queued_task );
+  ready_keys_.push_back( key );
+  work_cond_.notify_one();
+}
+
+void KeyedThreadPool::waitIdle()
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  while ( !queues_.empty() )
+  {
+    idle_cond_.wait( lock );
+  }
+}
+
+KeyedThreadPoolStats KeyedThreadPool::getStats() const
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  return stats_;
+}
+
+void KeyedThreadPool::workerThread()
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+
+  while ( true )
+  {
+    // finish the remaining work before shutting down
+    while ( ready_keys_.empty() )
+    {
+      if ( shutdown_ && num_running_ == 0 )
+      {
+        // wake up the other workers, which might still wait for running tasks
+        work_cond_.notify_all();
+        return;
+      }
+      work_cond_.wait( lock );
+    }
+
+    std::string key;
+    key.swap( ready_keys_.front() );
+    ready_keys_.pop_front();
+
+    std::deque<QueuedTask> &queue = queues_[key];
+    Task task;
+    task.swap( queue.front().task );
+    queue.pop_front();
+
+    stats_.queued--;
+    num_running_++;
+    space_cond_.notify_one();
+
+    lock.unlock();
+    try
+    {
+      task();
+    }
+    catch ( std::exception &e )
+    {
+      ROS_ERROR( "Exception thrown while processing task for %s: %s", key.c_str(), e.what() );
+    }
+    lock.lock();
+
+    num_running_--;
+    stats_.completed++;
+
+    // the queue might have been rehashed while we were running,
+    // so look it up again
+    M_TaskQueue::iterator it = queues_.find( key );
+    if ( it->second.empty() )
+    {
+      queues_.erase( it );
+      if ( queues_.empty() )
+      {
+        idle_cond_.notify_all();
+      }
+      if ( shutdown_ && num_running_ == 0 )
+      {
+        work_cond_.notify_all();
+      }
+    }
+    else
+    {
+      ready_keys_.push_back( key );
+      work_cond_.notify_one();
+    }
+  }
+}
+
+}
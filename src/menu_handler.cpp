@@ -34,6 +34,8 @@
 #include <boost/bind.hpp>
 #include <boost/make_shared.hpp>
 
+#include <utility>
+
 namespace interactive_markers
 {
 
@@ -138,20 +140,23 @@ bool MenuHandler::getCheckState( EntryHandle handle, CheckState &check_state ) c
 
 bool MenuHandler::apply( InteractiveMarkerServer &server, const std::string &marker_name )
 {
-  visualization_msgs::InteractiveMarker int_marker;
+  visualization_msgs::InteractiveMarkerConstPtr current = server.getShared( marker_name );
 
-  if ( !server.get( marker_name, int_marker ) )
+  if ( !current )
   {
     // This marker has been deleted on the server, so forget it.
     managed_markers_.erase( marker_name );
     return false;
   }
 
+  // the marker is shared with the server, so we need a copy to modify
+  visualization_msgs::InteractiveMarker int_marker( *current );
+
   int_marker.menu_entries.clear();
 
   pushMenuEntries( top_level_handles_, int_marker.menu_entries, 0 );
 
-  server.insert( int_marker );
+  server.insert( std::move( int_marker ) );
   server.setCallback( marker_name, boost::bind( &MenuHandler::processFeedback, this, _1 ), visualization_msgs::InteractiveMarkerFeedback::MENU_SELECT );
   managed_markers_.insert( marker_name );
   return true;
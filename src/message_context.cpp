@@ -43,16 +43,18 @@ namespace interactive_markers
 
 template<class MsgT>
 MessageContext<MsgT>::MessageContext(
-    tf2_ros::Buffer& tf,
+    TransformCache& transforms,
     const std::string& target_frame,
     const typename MsgT::ConstPtr& _msg,
     bool enable_autocomplete_transparency)
-: tf_(tf)
+: transforms_(transforms)
 , target_frame_(target_frame)
 , enable_autocomplete_transparency_(enable_autocomplete_transparency)
+, tf_requested_(false)
+, num_tf_notifications_(0)
 {
-  // copy message, as we will be modifying it
-  msg = boost::make_shared<MsgT>( *_msg );
+  // the message is only copied if it has to be modified
+  msg = _msg;
 
   init();
 }
@@ -62,40 +64,91 @@ MessageContext<MsgT>& MessageContext<MsgT>::operator=( const MessageContext<MsgT
 {
   open_marker_idx_ = other.open_marker_idx_;
   open_pose_idx_ = other.open_pose_idx_;
+  tf_requested_ = other.tf_requested_;
+  num_tf_notifications_ = other.num_tf_notifications_;
   target_frame_ = other.target_frame_;
   enable_autocomplete_transparency_ = other.enable_autocomplete_transparency_;
   return *this;
 }
 
 template<class MsgT>
-bool MessageContext<MsgT>::getTransform( std_msgs::Header& header, geometry_msgs::Pose& pose_msg )
+MsgT& MessageContext<MsgT>::writableMsg()
 {
-  try
+  if ( !writable_msg_ )
   {
-    if ( header.frame_id != target_frame_ )
-    {
-      // get transform
-      geometry_msgs::TransformStamped transform;
-      transform = tf_.lookupTransform( target_frame_, header.frame_id, header.stamp );
-      DBG_MSG( "Transform %s -> %s at time %f is ready.", header.frame_id.c_str(), target_frame_.c_str(), header.stamp.toSec() );
+    writable_msg_ = boost::make_shared<MsgT>( *msg );
+    msg = writable_msg_;
+  }
+  return *writable_msg_;
+}
 
-      // if timestamp is given, transform message into target frame
-      if ( header.stamp != ros::Time(0) )
+template<class MsgT>
+bool MessageContext<MsgT>::needsTransform( const std_msgs::Header& header ) const
+{
+  // messages without timestamp only need the transform to be available
+  return header.frame_id != target_frame_ && header.stamp != ros::Time(0);
+}
+
+template<class MsgT>
+bool MessageContext<MsgT>::needsTransform( const visualization_msgs::InteractiveMarker& int_marker ) const
+{
+  if ( needsTransform( int_marker.header ) )
+  {
+    return true;
+  }
+  for ( unsigned c = 0; c<int_marker.controls.size(); c++ )
+  {
+    const visualization_msgs::InteractiveMarkerControl& ctrl_msg = int_marker.controls[c];
+    for ( unsigned m = 0; m<ctrl_msg.markers.size(); m++ )
+    {
+      const std_msgs::Header& header = ctrl_msg.markers[m].header;
+      if ( !header.frame_id.empty() && needsTransform( header ) )
       {
-        tf2::doTransform(pose_msg, pose_msg, transform);
-        ROS_DEBUG_STREAM("Changing " << header.frame_id << " to "<< target_frame_);
-        header.frame_id = target_frame_;
+        return true;
       }
     }
   }
-  catch ( const tf2::ExtrapolationException& e )
+  return false;
+}
+
+template<class MsgT>
+bool MessageContext<MsgT>::isWaitingForTf() const
+{
+  return ( !open_marker_idx_.empty() || !open_pose_idx_.empty() ) &&
+      tf_requested_ && transforms_.getNumNotifications() == num_tf_notifications_;
+}
+
+template<class MsgT>
+void MessageContext<MsgT>::beginTfAttempt()
+{
+  // an arrival during the attempt has to trigger another one
+  num_tf_notifications_ = transforms_.getNumNotifications();
+  tf_requested_ = true;
+}
+
+template<class MsgT>
+void MessageContext<MsgT>::requestTf( const std_msgs::Header& header )
+{
+  if ( !transforms_.requestNotification( target_frame_, header.frame_id, header.stamp ) )
+  {
+    // try again next time
+    tf_requested_ = false;
+  }
+}
+
+template<class MsgT>
+bool MessageContext<MsgT>::lookupTransform( const std_msgs::Header& header, geometry_msgs::TransformStamped& transform )
+{
+  std::string error;
+  switch ( transforms_.getTransform( target_frame_, header.frame_id, header.stamp, transform, error ) )
   {
-    ros::Time latest_time;
-    std::string error_string;
+  case TransformCache::NONE:
+    DBG_MSG( "Transform %s -> %s at time %f is ready.", header.frame_id.c_str(), target_frame_.c_str(), header.stamp.toSec() );
+    return true;
 
-    tf_._getLatestCommonTime( tf_._lookupFrameNumber(target_frame_),
-                              tf_._lookupFrameNumber(header.frame_id),
-                              latest_time, &error_string );
+  case TransformCache::EXTRAPOLATION:
+  {
+    ros::Time latest_time = transforms_.getLatestCommonTime( target_frame_, header.frame_id );
 
     // if we have some tf info and it is newer than the requested time,
     // we are very unlikely to ever receive the old tf info in the future.
@@ -107,32 +160,89 @@ bool MessageContext<MsgT>::getTransform( std_msgs::Header& header, geometry_msgs
         << "' at time " << header.stamp << ").";
       throw InitFailException( s.str() );
     }
+    requestTf( header );
+    return false;
+  }
+
+  case TransformCache::LOOKUP:
+    // the frame might still appear
+    requestTf( header );
+    throw tf2::LookupException( error );
+
+  case TransformCache::CONNECTIVITY:
+    requestTf( header );
+    throw tf2::ConnectivityException( error );
+
+  default:
+    // all other errors need to be handled outside
+    throw tf2::TransformException( error );
+  }
+}
+
+template<class MsgT>
+bool MessageContext<MsgT>::getTransform( std_msgs::Header& header, geometry_msgs::Pose& pose_msg )
+{
+  if ( header.frame_id == target_frame_ )
+  {
+    return true;
+  }
+
+  geometry_msgs::TransformStamped transform;
+  if ( !lookupTransform( header, transform ) )
+  {
     return false;
   }
+
+  // if timestamp is given, transform message into target frame
+  if ( header.stamp != ros::Time(0) )
+  {
+    tf2::doTransform(pose_msg, pose_msg, transform);
+    ROS_DEBUG_STREAM("Changing " << header.frame_id << " to "<< target_frame_);
+    header.frame_id = target_frame_;
+  }
   return true;
-  // all other exceptions need to be handled outside
 }
 
 template<class MsgT>
-void MessageContext<MsgT>::getTfTransforms( std::vector<visualization_msgs::InteractiveMarker>& msg_vec, std::list<size_t>& indices )
+bool MessageContext<MsgT>::getTransform( const std_msgs::Header& header, const geometry_msgs::Pose& )
+{
+  geometry_msgs::TransformStamped transform;
+  return header.frame_id == target_frame_ || lookupTransform( header, transform );
+}
+
+template<class MsgT>
+template<class IntMarkerT>
+bool MessageContext<MsgT>::getTransforms( IntMarkerT& im_msg )
+{
+  // transform interactive marker
+  bool success = getTransform( im_msg.header, im_msg.pose );
+  // transform regular markers
+  for ( unsigned c = 0; c<im_msg.controls.size(); c++ )
+  {
+    for ( unsigned m = 0; m<im_msg.controls[c].markers.size(); m++ )
+    {
+      if ( !im_msg.controls[c].markers[m].header.frame_id.empty() ) {
+        success = success && getTransform( im_msg.controls[c].markers[m].header, im_msg.controls[c].markers[m].pose );
+      }
+    }
+  }
+  return success;
+}
+
+template<class MsgT>
+void MessageContext<MsgT>::getTfTransforms( std::vector<visualization_msgs::InteractiveMarker> MsgT::*markers, std::list<size_t>& indices )
 {
   std::list<size_t>::iterator idx_it;
   for ( idx_it = indices.begin(); idx_it != indices.end(); )
   {
-    visualization_msgs::InteractiveMarker& im_msg = msg_vec[ *idx_it ];
-    // transform interactive marker
-    bool success = getTransform( im_msg.header, im_msg.pose );
-    // transform regular markers
-    for ( unsigned c = 0; c<im_msg.controls.size(); c++ )
+    bool success;
+    if ( needsTransform( ((*msg).*markers)[ *idx_it ] ) )
     {
-      visualization_msgs::InteractiveMarkerControl& ctrl_msg = im_msg.controls[c];
-      for ( unsigned m = 0; m<ctrl_msg.markers.size(); m++ )
-      {
-        visualization_msgs::Marker& marker_msg = ctrl_msg.markers[m];
-        if ( !marker_msg.header.frame_id.empty() ) {
-          success = success && getTransform( marker_msg.header, marker_msg.pose );
-        }
-      }
+      success = getTransforms( (writableMsg().*markers)[ *idx_it ] );
+    }
+    else
+    {
+      success = getTransforms( ((*msg).*markers)[ *idx_it ] );
     }
 
     if ( success )
@@ -141,26 +251,39 @@ void MessageContext<MsgT>::getTfTransforms( std::vector<visualization_msgs::Inte
     }
     else
     {
-      DBG_MSG( "Transform %s -> %s at time %f is not ready.", im_msg.header.frame_id.c_str(), target_frame_.c_str(), im_msg.header.stamp.toSec() );
+      const std_msgs::Header& header = ((*msg).*markers)[ *idx_it ].header;
+      DBG_MSG( "Transform %s -> %s at time %f is not ready.", header.frame_id.c_str(), target_frame_.c_str(), header.stamp.toSec() );
       ++idx_it;
     }
   }
 }
 
 template<class MsgT>
-void MessageContext<MsgT>::getTfTransforms( std::vector<visualization_msgs::InteractiveMarkerPose>& msg_vec, std::list<size_t>& indices )
+void MessageContext<MsgT>::getTfTransforms( std::vector<visualization_msgs::InteractiveMarkerPose> MsgT::*poses, std::list<size_t>& indices )
 {
   std::list<size_t>::iterator idx_it;
   for ( idx_it = indices.begin(); idx_it != indices.end(); )
   {
-    visualization_msgs::InteractiveMarkerPose& msg = msg_vec[ *idx_it ];
-    if ( getTransform( msg.header, msg.pose ) )
+    bool success;
+    if ( needsTransform( ((*msg).*poses)[ *idx_it ].header ) )
+    {
+      visualization_msgs::InteractiveMarkerPose& pose_msg = (writableMsg().*poses)[ *idx_it ];
+      success = getTransform( pose_msg.header, pose_msg.pose );
+    }
+    else
+    {
+      const visualization_msgs::InteractiveMarkerPose& pose_msg = ((*msg).*poses)[ *idx_it ];
+      success = getTransform( pose_msg.header, pose_msg.pose );
+    }
+
+    if ( success )
     {
       idx_it = indices.erase(idx_it);
     }
     else
     {
-      DBG_MSG( "Transform %s -> %s at time %f is not ready.", msg.header.frame_id.c_str(), target_frame_.c_str(), msg.header.stamp.toSec() );
+      const std_msgs::Header& header = ((*msg).*poses)[ *idx_it ].header;
+      DBG_MSG( "Transform %s -> %s at time %f is not ready.", header.frame_id.c_str(), target_frame_.c_str(), header.stamp.toSec() );
       ++idx_it;
     }
   }
@@ -186,15 +309,19 @@ void MessageContext<visualization_msgs::InteractiveMarkerUpdate>::init()
   }
   for( unsigned i=0; i<msg->markers.size(); i++ )
   {
-    autoComplete( msg->markers[i], enable_autocomplete_transparency_  );
+    // only copy the message if autocompletion changes anything
+    if ( !isAutoCompleted( msg->markers[i], enable_autocomplete_transparency_ ) )
+    {
+      autoComplete( writableMsg().markers[i], enable_autocomplete_transparency_  );
+    }
   }
   for( unsigned i=0; i<msg->poses.size(); i++ )
   {
     // correct empty orientation
-    if ( msg->poses[i].pose.orientation.w == 0 && msg->poses[i].pose.orientation.x == 0 &&
-        msg->poses[i].pose.orientation.y == 0 && msg->poses[i].pose.orientation.z == 0 )
+    const geometry_msgs::Quaternion& orientation = msg->poses[i].pose.orientation;
+    if ( orientation.w == 0 && orientation.x == 0 && orientation.y == 0 && orientation.z == 0 )
     {
-      msg->poses[i].pose.orientation.w = 1;
+      writableMsg().poses[i].pose.orientation.w = 1;
     }
   }
 }
@@ -209,15 +336,23 @@ void MessageContext<visualization_msgs::InteractiveMarkerInit>::init()
   }
   for( unsigned i=0; i<msg->markers.size(); i++ )
   {
-    autoComplete( msg->markers[i], enable_autocomplete_transparency_ );
+    if ( !isAutoCompleted( msg->markers[i], enable_autocomplete_transparency_ ) )
+    {
+      autoComplete( writableMsg().markers[i], enable_autocomplete_transparency_ );
+    }
   }
 }
 
 template<>
 void MessageContext<visualization_msgs::InteractiveMarkerUpdate>::getTfTransforms( )
 {
-  getTfTransforms( msg->markers, open_marker_idx_ );
-  getTfTransforms( msg->poses, open_pose_idx_ );
+  if ( isWaitingForTf() )
+  {
+    return;
+  }
+  beginTfAttempt();
+  getTfTransforms( &visualization_msgs::InteractiveMarkerUpdate::markers, open_marker_idx_ );
+  getTfTransforms( &visualization_msgs::InteractiveMarkerUpdate::poses, open_pose_idx_ );
   if ( isReady() )
   {
     DBG_MSG( "Update message with seq_num=%lu is ready.", msg->seq_num );
@@ -227,7 +362,12 @@ void MessageContext<visualization_msgs::InteractiveMarkerUpdate>::getTfTransform
 template<>
 void MessageContext<visualization_msgs::InteractiveMarkerInit>::getTfTransforms( )
 {
-  getTfTransforms( msg->markers, open_marker_idx_ );
+  if ( isWaitingForTf() )
+  {
+    return;
+  }
+  beginTfAttempt();
+  getTfTransforms( &visualization_msgs::InteractiveMarkerInit::markers, open_marker_idx_ );
   if ( isReady() )
   {
     DBG_MSG( "Init message with seq_num=%lu is ready.", msg->seq_num );
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "interactive_markers/detail/shared_marker.h"
+
+#include <string.h>
+
+namespace interactive_markers
+{
+
+// serialize the contents of the marker into buffer, starting at offset
+static void serializeContents( const visualization_msgs::InteractiveMarker &int_marker,
+    std::vector<uint8_t> &buffer, uint32_t offset, uint32_t length )
+{
+  namespace ser = ros::serialization;
+
+  buffer.resize( offset + length );
+  if ( length > 0 )
+  {
+    ser::OStream stream( &buffer[offset], length );
+    ser::serialize( stream, MarkerContents( int_marker ) );
+  }
+}
+
+uint64_t hashMarkerContents( const visualization_msgs::InteractiveMarker &int_marker, std::vector<uint8_t> &buffer )
+{
+  namespace ser = ros::serialization;
+
+  uint32_t length = ser::serializationLength( MarkerContents( int_marker ) );
+  serializeContents( int_marker, buffer, 0, length );
+
+  uint64_t hash = 14695981039346656037ULL;
+  for ( uint32_t i = 0; i < length; i++ )
+  {
+    hash ^= buffer[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash != 0 ? hash : 1;
+}
+
+bool isSameMarkerContents( const visualization_msgs::InteractiveMarker &a,
+    const visualization_msgs::InteractiveMarker &b, std::vector<uint8_t> &buffer )
+{
+  namespace ser = ros::serialization;
+
+  if ( &a == &b )
+  {
+    return true;
+  }
+
+  uint32_t length = ser::serializationLength( MarkerContents( a ) );
+  if ( length != ser::serializationLength( MarkerContents( b ) ) )
+  {
+    return false;
+  }
+  serializeContents( a, buffer, 0, length );
+  serializeContents( b, buffer, length, length );
+  return length == 0 || memcmp( &buffer[0], &buffer[length], length ) == 0;
+}
+
+}
@@ -42,18 +42,19 @@ namespace interactive_markers
 
 SingleClient::SingleClient(
     const std::string& server_id,
-    tf2_ros::Buffer &tf,
+    TransformCache& transforms,
     const std::string& target_frame,
     const InteractiveMarkerClient::CbCollection& callbacks
 )
 : state_(server_id,INIT)
 , first_update_seq_num_(-1)
 , last_update_seq_num_(-1)
-, tf_(tf)
+, transforms_(transforms)
 , target_frame_(target_frame)
 , callbacks_(callbacks)
 , server_id_(server_id)
 , warn_keepalive_(false)
+, reorder_(false)
 {
   callbacks_.statusCb( InteractiveMarkerClient::OK, server_id_, "Waiting for init message." );
 }
@@ -75,7 +76,7 @@ void SingleClient::process(const visualization_msgs::InteractiveMarkerInit::Cons
       DBG_MSG( "Init queue too large. Erasing init message with id %lu.", init_queue_.begin()->msg->seq_num );
       init_queue_.pop_back();
     }
-    init_queue_.push_front( InitMessageContext(tf_, target_frame_, msg, enable_autocomplete_transparency ) );
+    init_queue_.push_front( InitMessageContext(transforms_, target_frame_, msg, enable_autocomplete_transparency ) );
     callbacks_.statusCb( InteractiveMarkerClient::OK, server_id_, "Init message received." );
     break;
 
@@ -97,29 +98,59 @@ void SingleClient::process(const visualization_msgs::InteractiveMarkerUpdate::Co
   if ( msg->type == msg->KEEP_ALIVE )
   {
     DBG_MSG( "%s: received keep-alive #%lu", server_id_.c_str(), msg->seq_num );
-    if (last_update_seq_num_ != (uint64_t)-1 && msg->seq_num != last_update_seq_num_ )
+    if ( last_update_seq_num_ == (uint64_t)-1 )
+    {
+      last_update_seq_num_ = msg->seq_num;
+    }
+    else if ( reorder_ )
+    {
+      // Updates sent after it on another channel might have overtaken it.
+      // If it is ahead, wait for the updates up to it (without replacing them).
+      if ( msg->seq_num > last_update_seq_num_ )
+      {
+        bufferUpdate( msg, false );
+      }
+    }
+    else if ( msg->seq_num != last_update_seq_num_ )
     {
       std::ostringstream s;
       s << "Sequence number of update is out of order. Expected: " << last_update_seq_num_ << " Received: " << msg->seq_num;
       errorReset( s.str() );
-      return;
     }
-    last_update_seq_num_ = msg->seq_num;
     return;
   }
-  else
+
+  DBG_MSG( "%s: received update #%lu", server_id_.c_str(), msg->seq_num );
+  if ( last_update_seq_num_ == (uint64_t)-1 || msg->seq_num == last_update_seq_num_+1 )
   {
-    DBG_MSG( "%s: received update #%lu", server_id_.c_str(), msg->seq_num );
-    if (last_update_seq_num_ != (uint64_t)-1 && msg->seq_num != last_update_seq_num_+1 )
-    {
-      std::ostringstream s;
-      s << "Sequence number of update is out of order. Expected: " << last_update_seq_num_+1 << " Received: " << msg->seq_num;
-      errorReset( s.str() );
-      return;
-    }
-    last_update_seq_num_ = msg->seq_num;
+    processInOrder( msg, enable_autocomplete_transparency );
+    processBufferedUpdates( enable_autocomplete_transparency );
+    return;
+  }
+
+  if ( reorder_ && msg->seq_num > last_update_seq_num_+1 )
+  {
+    bufferUpdate( msg, true );
+    return;
   }
 
+  // Before initialization, a keep-alive can overtake updates sent on another channel.
+  // Those are covered by the init message anyway.
+  if ( reorder_ && state_ == INIT && msg->seq_num <= last_update_seq_num_ )
+  {
+    DBG_MSG( "%s: dropping late update #%lu", server_id_.c_str(), msg->seq_num );
+    return;
+  }
+
+  std::ostringstream s;
+  s << "Sequence number of update is out of order. Expected: " << last_update_seq_num_+1 << " Received: " << msg->seq_num;
+  errorReset( s.str() );
+}
+
+void SingleClient::processInOrder(const visualization_msgs::InteractiveMarkerUpdate::ConstPtr& msg, bool enable_autocomplete_transparency)
+{
+  last_update_seq_num_ = msg->seq_num;
+
   switch (state_)
   {
   case INIT:
@@ -128,11 +159,11 @@ void SingleClient::process(const visualization_msgs::InteractiveMarkerUpdate::Co
       DBG_MSG( "Update queue too large. Erasing update message with id %lu.", update_queue_.begin()->msg->seq_num );
       update_queue_.pop_back();
     }
-    update_queue_.push_front( UpdateMessageContext(tf_, target_frame_, msg, enable_autocomplete_transparency) );
+    update_queue_.push_front( UpdateMessageContext(transforms_, target_frame_, msg, enable_autocomplete_transparency) );
     break;
 
   case RECEIVING:
-    update_queue_.push_front( UpdateMessageContext(tf_, target_frame_, msg, enable_autocomplete_transparency) );
+    update_queue_.push_front( UpdateMessageContext(transforms_, target_frame_, msg, enable_autocomplete_transparency) );
     break;
 
   case TF_ERROR:
@@ -140,24 +171,115 @@ void SingleClient::process(const visualization_msgs::InteractiveMarkerUpdate::Co
   }
 }
 
+void SingleClient::bufferUpdate(const visualization_msgs::InteractiveMarkerUpdate::ConstPtr& msg, bool replace)
+{
+  ros::Time now = ros::Time::now();
+  if ( out_of_order_updates_.empty() )
+  {
+    out_of_order_since_ = now;
+  }
+
+  BufferedUpdate buffered;
+  buffered.msg = msg;
+  buffered.arrival_time = now;
+  std::pair< std::map< uint64_t, BufferedUpdate >::iterator, bool > inserted =
+      out_of_order_updates_.insert( std::make_pair( msg->seq_num, buffered ) );
+  if ( !inserted.second && replace )
+  {
+    // keep waiting since the first one arrived
+    inserted.first->second.msg = msg;
+  }
+
+  if ( out_of_order_updates_.size() > 100 )
+  {
+    errorReset( "Too many updates waiting for missing sequence numbers. Resetting connection." );
+  }
+}
+
+void SingleClient::processBufferedUpdates(bool enable_autocomplete_transparency)
+{
+  bool processed = false;
+  while ( !out_of_order_updates_.empty() )
+  {
+    visualization_msgs::InteractiveMarkerUpdate::ConstPtr msg = out_of_order_updates_.begin()->second.msg;
+    if ( msg->type == msg->KEEP_ALIVE ? msg->seq_num > last_update_seq_num_ : msg->seq_num != last_update_seq_num_+1 )
+    {
+      break;
+    }
+    out_of_order_updates_.erase( out_of_order_updates_.begin() );
+    processed = true;
+    if ( msg->type != msg->KEEP_ALIVE )
+    {
+      processInOrder( msg, enable_autocomplete_transparency );
+    }
+  }
+
+  // The next gap has been open at least since the oldest of the remaining updates arrived.
+  if ( processed && !out_of_order_updates_.empty() )
+  {
+    std::map< uint64_t, BufferedUpdate >::const_iterator it = out_of_order_updates_.begin();
+    out_of_order_since_ = it->second.arrival_time;
+    for ( ++it; it != out_of_order_updates_.end(); ++it )
+    {
+      if ( it->second.arrival_time < out_of_order_since_ )
+      {
+        out_of_order_since_ = it->second.arrival_time;
+      }
+    }
+  }
+}
+
+void SingleClient::enableReordering()
+{
+  reorder_ = true;
+}
+
 void SingleClient::update()
+{
+  updateTf();
+  deliver();
+}
+
+void SingleClient::updateTf()
 {
   switch (state_)
   {
   case INIT:
     transformInitMsgs();
     transformUpdateMsgs();
-    checkInitFinished();
     break;
 
   case RECEIVING:
     transformUpdateMsgs();
+    break;
+
+  case TF_ERROR:
+    break;
+  }
+}
+
+void SingleClient::deliver()
+{
+  switch (state_)
+  {
+  case INIT:
+    reportTfErrors();
+    checkInitFinished();
+    checkMissingUpdates();
+    break;
+
+  case RECEIVING:
+    reportTfErrors();
     pushUpdates();
     checkKeepAlive();
     if ( update_queue_.size() > 100 )
     {
       errorReset( "Update queue overflow. Resetting connection." );
     }
+    else
+    {
+      checkMissingUpdates();
+    }
     break;
 
   case TF_ERROR:
@@ -187,6 +309,16 @@ void SingleClient::checkKeepAlive()
   }
 }
 
+void SingleClient::checkMissingUpdates()
+{
+  if ( !out_of_order_updates_.empty() && ( ros::Time::now() - out_of_order_since_ ).toSec() > 1.0 )
+  {
+    std::ostringstream s;
+    s << "Update #" << last_update_seq_num_+1 << " is missing for more than 1 second. Resetting connection.";
+    errorReset( s.str() );
+  }
+}
+
 void SingleClient::checkInitFinished()
 {
   // check for all init messages received so far if tf info is ready
@@ -247,7 +379,7 @@ void SingleClient::transformInitMsgs()
       // in case it is the only one we will receive.
       std::ostringstream s;
       s << "Cannot get tf info for init message with sequence number " << it->msg->seq_num << ". Error: " << e.what();
-      callbacks_.statusCb( InteractiveMarkerClient::WARN, server_id_, s.str() );
+      init_tf_warnings_.push_back( s.str() );
     }
     ++it;
   }
@@ -266,24 +398,40 @@ void SingleClient::transformUpdateMsgs( )
     {
       std::ostringstream s;
       s << "Resetting due to tf error: " << e.what();
-      errorReset( s.str() );
+      tf_reset_error_ = s.str();
       return;
     }
     catch ( ... )
     {
-      std::ostringstream s;
-      s << "Resetting due to unknown exception";
-      errorReset( s.str() );
+      tf_reset_error_ = "Resetting due to unknown exception";
+      return;
     }
   }
 }
 
+void SingleClient::reportTfErrors()
+{
+  for ( size_t i = 0; i < init_tf_warnings_.size(); i++ )
+  {
+    callbacks_.statusCb( InteractiveMarkerClient::WARN, server_id_, init_tf_warnings_[i] );
+  }
+  init_tf_warnings_.clear();
+
+  if ( !tf_reset_error_.empty() )
+  {
+    std::string error_msg;
+    error_msg.swap( tf_reset_error_ );
+    errorReset( error_msg );
+  }
+}
+
 void SingleClient::errorReset( std::string error_msg )
 {
   // if we get an error here, we re-initialize everything
   state_ = TF_ERROR;
   update_queue_.clear();
   init_queue_.clear();
+  out_of_order_updates_.clear();
   first_update_seq_num_ = -1;
   last_update_seq_num_ = -1;
   warn_keepalive_ = false;
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "interactive_markers/detail/spatial_grid.h"
+
+#include <boost/functional/hash.hpp>
+
+#include <cmath>
+#include <limits>
+
+namespace interactive_markers
+{
+
+SpatialGrid::SpatialGrid( double cell_size ) :
+    cell_size_(cell_size),
+    size_(0)
+{
+}
+
+std::size_t SpatialGrid::CellKeyHash::operator()( const CellKey &key ) const
+{
+  std::size_t seed = key.frame;
+  boost::hash_combine( seed, key.x );
+  boost::hash_combine( seed, key.y );
+  boost::hash_combine( seed, key.z );
+  return seed;
+}
+
+int64_t SpatialGrid::cellCoordinate( double value ) const
+{
+  // keep far away (or invalid) points from overflowing
+  double cell = std::floor( value / cell_size_ );
+  if ( !( cell > -1e15 ) )
+  {
+    return -1000000000000000LL;
+  }
+  if ( cell > 1e15 )
+  {
+    return 1000000000000000LL;
+  }
+  return static_cast<int64_t>( cell );
+}
+
+void SpatialGrid::update( uint32_t id, const std::string &frame_id, double x, double y, double z )
+{
+  boost::unordered_map<std::string, uint32_t>::iterator frame_it = frames_.find( frame_id );
+  if ( frame_it == frames_.end() )
+  {
+    frame_it = frames_.insert( std::make_pair( frame_id, uint32_t( frames_.size() ) ) ).first;
+  }
+
+  CellKey cell;
+  cell.frame = frame_it->second;
+  cell.x = cellCoordinate( x );
+  cell.y = cellCoordinate( y );
+  cell.z = cellCoordinate( z );
+
+  if ( id >= entries_.size() )
+  {
+    entries_.resize( id + 1 );
+  }
+
+  Entry &entry = entries_[id];
+  if ( entry.valid && entry.cell == cell )
+  {
+    entry.x = x;
+    entry.y = y;
+    entry.z = z;
+    return;
+  }
+
+  remove( id );
+
+  std::vector<uint32_t> &cell_ids = cells_[cell];
+  entry.valid = true;
+  entry.cell = cell;
+  entry.x = x;
+  entry.y = y;
+  entry.z = z;
+  entry.cell_index = cell_ids.size();
+  cell_ids.push_back( id );
+  size_++;
+}
+
+void SpatialGrid::remove( uint32_t id )
+{
+  if ( id >= entries_.size() || !entries_[id].valid )
+  {
+    return;
+  }
+
+  Entry &entry = entries_[id];
+  boost::unordered_map< CellKey, std::vector<uint32_t>, CellKeyHash >::iterator cell_it = cells_.find( entry.cell );
+  std::vector<uint32_t> &cell_ids = cell_it->second;
+
+  // fill the gap with the last id of the cell
+  uint32_t last_id = cell_ids.back();
+  cell_ids[entry.cell_index] = last_id;
+  entries_[last_id].cell_index = entry.cell_index;
+  cell_ids.pop_back();
+  if ( cell_ids.empty() )
+  {
+    cells_.erase( cell_it );
+  }
+
+  entry.valid = false;
+  size_--;
+}
+
+void SpatialGrid::clear()
+{
+  cells_.clear();
+  entries_.clear();
+  size_ = 0;
+}
+
+namespace
+{
+
+struct BoxVisitor
+{
+  double min_x, min_y, min_z, max_x, max_y, max_z;
+  std::vector<uint32_t> *ids;
+
+  void operator()( uint32_t id, double x, double y, double z )
+  {
+    if ( x >= min_x && x <= max_x && y >= min_y && y <= max_y && z >= min_z && z <= max_z )
+    {
+      ids->push_back( id );
+    }
+  }
+};
+
+struct RadiusVisitor
+{
+  double x, y, z, radius_squared;
+  std::vector<uint32_t> *ids;
+
+  void operator()( uint32_t id, double px, double py, double pz )
+  {
+    double dx = px - x, dy = py - y, dz = pz - z;
+    if ( dx*dx + dy*dy + dz*dz <= radius_squared )
+    {
+      ids->push_back( id );
+    }
+  }
+};
+
+}
+
+template<class Visitor>
+void SpatialGrid::visitCells( uint32_t frame, double min_x, double min_y, double min_z,
+    double max_x, double max_y, double max_z, Visitor &visitor ) const
+{
+  CellKey min_cell, max_cell;
+  min_cell.x = cellCoordinate( min_x );
+  min_cell.y = cellCoordinate( min_y );
+  min_cell.z = cellCoordinate( min_z );
+  max_cell.x = cellCoordinate( max_x );
+  max_cell.y = cellCoordinate( max_y );
+  max_cell.z = cellCoordinate( max_z );
+
+  // for large regions, looking at every point is cheaper than looking up every cell
+  double num_cells = double( max_cell.x - min_cell.x + 1 ) *
+      double( max_cell.y - min_cell.y + 1 ) * double( max_cell.z - min_cell.z + 1 );
+  if ( num_cells > double( cells_.size() ) )
+  {
+    for ( uint32_t id = 0; id < entries_.size(); id++ )
+    {
+      const Entry &entry = entries_[id];
+      if ( entry.valid && entry.cell.frame == frame )
+      {
+        visitor( id, entry.x, entry.y, entry.z );
+      }
+    }
+    return;
+  }
+
+  CellKey cell;
+  cell.frame = frame;
+  for ( cell.x = min_cell.x; cell.x <= max_cell.x; cell.x++ )
+  {
+    for ( cell.y = min_cell.y; cell.y <= max_cell.y; cell.y++ )
+    {
+      for ( cell.z = min_cell.z; cell.z <= max_cell.z; cell.z++ )
+      {
+        boost::unordered_map< CellKey, std::vector<uint32_t>, CellKeyHash >::const_iterator cell_it = cells_.find( cell );
+        if ( cell_it == cells_.end() )
+        {
+          continue;
+        }
+        const std::vector<uint32_t> &cell_ids = cell_it->second;
+        for ( std::size_t i = 0; i < cell_ids.size(); i++ )
+        {
+          const Entry &entry = entries_[cell_ids[i]];
+          visitor( cell_ids[i], entry.x, entry.y, entry.z );
+        }
+      }
+    }
+  }
+}
+
+void SpatialGrid::queryBox( const std::string &frame_id, double min_x, double min_y, double min_z,
+    double max_x, double max_y, double max_z, std::vector<uint32_t> &ids ) const
+{
+  boost::unordered_map<std::string, uint32_t>::const_iterator frame_it = frames_.find( frame_id );
+  if ( frame_it == frames_.end() || min_x > max_x || min_y > max_y || min_z > max_z )
+  {
+    return;
+  }
+
+  BoxVisitor visitor;
+  visitor.min_x = min_x;
+  visitor.min_y = min_y;
+  visitor.min_z = min_z;
+  visitor.max_x = max_x;
+  visitor.max_y = max_y;
+  visitor.max_z = max_z;
+  visitor.ids = &ids;
+  visitCells( frame_it->second, min_x, min_y, min_z, max_x, max_y, max_z, visitor );
+}
+
+void SpatialGrid::queryRadius( const std::string &frame_id, double x, double y, double z, double radius,
+    std::vector<uint32_t> &ids ) const
+{
+  boost::unordered_map<std::string, uint32_t>::const_iterator frame_it = frames_.find( frame_id );
+  if ( frame_it == frames_.end() || radius < 0 )
+  {
+    return;
+  }
+
+  RadiusVisitor visitor;
+  visitor.x = x;
+  visitor.y = y;
+  visitor.z = z;
+  visitor.radius_squared = radius * radius;
+  visitor.ids = &ids;
+  visitCells( frame_it->second, x - radius, y - radius, z - radius, x + radius, y + radius, z + radius, visitor );
+}
+
+}
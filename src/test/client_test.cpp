@@ -35,6 +35,9 @@
 
 #include <interactive_markers/interactive_marker_server.h>
 #include <interactive_markers/interactive_marker_client.h>
+#include <interactive_markers/tools.h>
+#include <interactive_markers/detail/message_context.h>
+#include <interactive_markers/detail/transform_cache.h>
 
 #define DBG_MSG( ... ) printf( __VA_ARGS__ ); printf("\n");
 #define DBG_MSG_STREAM( ... )  std::cout << __VA_ARGS__ << std::endl;
@@ -49,17 +52,25 @@ struct Msg
     UPDATE,
     POSE,
     DELETE,
-    TF_INFO
+    TF_INFO,
+    WAIT
   } type;
 
   Msg()
   {
     type = INIT;
     seq_num = 0;
+    pose_channel = false;
   }
 
   uint64_t seq_num;
 
+  // for POSE: send on the pose channel instead of the update channel
+  bool pose_channel;
+
+  // for WAIT
+  ros::WallDuration wait_time;
+
   std::string server_id;
   std::string frame_id;
   ros::Time stamp;
@@ -116,6 +127,11 @@ class SequenceTest
   }
 
 public:
+  SequenceTest() : num_transform_threads(0) {}
+
+  // see InteractiveMarkerClient::setNumTransformThreads
+  unsigned int num_transform_threads;
+
   void test( std::vector<Msg> messages )
   {
     tf2_ros::Buffer tf;
@@ -133,6 +149,7 @@ public:
     client.setUpdateCb( boost::bind(&SequenceTest::updateCb, this, _1 ) );
     client.setResetCb( boost::bind(&SequenceTest::resetCb, this, _1 ) );
     client.setStatusCb( boost::bind(&SequenceTest::statusCb, this, _1, _2, _3 ) );
+    client.setNumTransformThreads( num_transform_threads );
 
     std::map< int, visualization_msgs::InteractiveMarkerInit > sent_init_msgs;
     std::map< int, visualization_msgs::InteractiveMarkerUpdate > sent_update_msgs;
@@ -202,7 +219,14 @@ public:
         pose.name=int_marker.name;
         pose.pose=int_marker.pose;
         update_msg_out->poses.push_back( pose );
-        client.processUpdate( update_msg_out );
+        if ( msg.pose_channel )
+        {
+          client.processPoseUpdate( update_msg_out );
+        }
+        else
+        {
+          client.processUpdate( update_msg_out );
+        }
         sent_update_msgs[msg.seq_num]=*update_msg_out;
         break;
       }
@@ -230,6 +254,12 @@ public:
         tf.setTransform( stf, msg.server_id );
         break;
       }
+      case Msg::WAIT:
+      {
+        DBG_MSG_STREAM( i << " WAIT: " << msg.wait_time.toSec() << "s" );
+        msg.wait_time.sleep();
+        break;
+      }
       }
 
       /*
@@ -460,7 +490,8 @@ TEST(InteractiveMarkerClient, init_invalid_tf)
   t.test(seq);
 }
 
-TEST(InteractiveMarkerClient, init_wait_tf)
+// init, update and pose messages that have to wait for tf info
+std::vector<Msg> makeWaitTfSequence()
 {
   Msg msg;
 
@@ -511,8 +542,21 @@ TEST(InteractiveMarkerClient, init_wait_tf)
   msg.expect_update_seq_num.push_back(2);
   seq.push_back(msg);
 
+  return seq;
+}
+
+TEST(InteractiveMarkerClient, init_wait_tf)
+{
   SequenceTest t;
-  t.test(seq);
+  t.test( makeWaitTfSequence() );
+}
+
+TEST(InteractiveMarkerClient, init_wait_tf_parallel)
+{
+  // same callbacks in the same order when transforming on worker threads
+  SequenceTest t;
+  t.num_transform_threads = 2;
+  t.test( makeWaitTfSequence() );
 }
 
 
@@ -910,6 +954,206 @@ TEST(InteractiveMarkerClient, init_twoservers)
   t.test(seq);
 }
 
+TEST(InteractiveMarkerClient, reorder_timeout)
+{
+  Msg msg;
+
+  std::vector<Msg> seq;
+
+  msg.type=Msg::INIT;
+  msg.seq_num=1;
+  msg.server_id="server1";
+  msg.frame_id=target_frame;
+  seq.push_back(msg);
+
+  msg.type=Msg::KEEP_ALIVE;
+  msg.expect_init_seq_num.push_back(1);
+  seq.push_back(msg);
+
+  msg.expect_init_seq_num.clear();
+
+  // pose updates overtake update #2
+  msg.type=Msg::POSE;
+  msg.pose_channel=true;
+  msg.seq_num=3;
+  seq.push_back(msg);
+
+  msg.seq_num=5;
+  seq.push_back(msg);
+
+  msg.type=Msg::WAIT;
+  msg.wait_time=ros::WallDuration(0.7);
+  seq.push_back(msg);
+
+  // #4 has been missing since #5 arrived, not just since #2 filled the first gap
+  msg.type=Msg::UPDATE;
+  msg.pose_channel=false;
+  msg.seq_num=2;
+  msg.expect_update_seq_num.push_back(2);
+  msg.expect_update_seq_num.push_back(3);
+  seq.push_back(msg);
+
+  msg.expect_update_seq_num.clear();
+
+  msg.type=Msg::WAIT;
+  msg.wait_time=ros::WallDuration(0.5);
+  msg.expect_reset_calls.push_back(msg.server_id);
+  seq.push_back(msg);
+
+  SequenceTest t;
+  t.test(seq);
+}
+
+TEST(InteractiveMarkerClient, transform_cache)
+{
+  tf2_ros::Buffer tf;
+  TransformCache cache( tf );
+
+  geometry_msgs::TransformStamped stf;
+  stf.header.frame_id = "target_frame";
+  stf.child_frame_id = "valid_frame";
+  stf.transform.translation.x = 1.0;
+  stf.transform.rotation.w = 1.0;
+  tf.setTransform( stf, "test", true );
+
+  ASSERT_EQ( 1.0, cache.lookupTransform( "target_frame", "valid_frame", ros::Time(0) ).transform.translation.x );
+
+  // the result is kept until the cache is cleared
+  stf.transform.translation.x = 2.0;
+  tf.setTransform( stf, "test", true );
+  ASSERT_EQ( 1.0, cache.lookupTransform( "target_frame", "valid_frame", ros::Time(0) ).transform.translation.x );
+  cache.clear();
+  ASSERT_EQ( 2.0, cache.lookupTransform( "target_frame", "valid_frame", ros::Time(0) ).transform.translation.x );
+
+  // so are errors, with their type
+  ASSERT_THROW( cache.lookupTransform( "target_frame", "unknown_frame", ros::Time(0) ), tf2::LookupException );
+  ASSERT_THROW( cache.lookupTransform( "target_frame", "unknown_frame", ros::Time(0) ), tf2::LookupException );
+}
+
+TEST(InteractiveMarkerClient, transform_cache_errors)
+{
+  tf2_ros::Buffer tf;
+  TransformCache cache( tf );
+
+  geometry_msgs::TransformStamped stf;
+  stf.header.frame_id = "target_frame";
+  stf.header.stamp = ros::Time( 1.0 );
+  stf.child_frame_id = "valid_frame";
+  stf.transform.rotation.w = 1.0;
+  tf.setTransform( stf, "test" );
+
+  geometry_msgs::TransformStamped transform;
+  std::string error;
+  ASSERT_EQ( TransformCache::NONE, cache.getTransform( "target_frame", "valid_frame", ros::Time( 1.0 ), transform, error ) );
+
+  // failures are reported without throwing
+  ASSERT_EQ( TransformCache::EXTRAPOLATION, cache.getTransform( "target_frame", "valid_frame", ros::Time( 2.0 ), transform, error ) );
+  ASSERT_FALSE( error.empty() );
+  ASSERT_EQ( TransformCache::LOOKUP, cache.getTransform( "target_frame", "unknown_frame", ros::Time( 1.0 ), transform, error ) );
+
+  ASSERT_EQ( ros::Time( 1.0 ), cache.getLatestCommonTime( "target_frame", "valid_frame" ) );
+  ASSERT_EQ( ros::Time(), cache.getLatestCommonTime( "target_frame", "unknown_frame" ) );
+}
+
+TEST(InteractiveMarkerClient, transform_notification)
+{
+  tf2_ros::Buffer tf;
+  TransformCache cache( tf );
+
+  // missing transform -> notification once it arrives
+  ASSERT_TRUE( cache.requestNotification( "target_frame", "new_frame", ros::Time(0) ) );
+  ASSERT_TRUE( cache.requestNotification( "target_frame", "new_frame", ros::Time(0) ) );
+  ASSERT_EQ( 0u, cache.getNumNotifications() );
+
+  geometry_msgs::TransformStamped stf;
+  stf.header.frame_id = "target_frame";
+  stf.child_frame_id = "new_frame";
+  stf.transform.rotation.w = 1.0;
+  tf.setTransform( stf, "test", true );
+
+  ASSERT_EQ( 1u, cache.getNumNotifications() );
+
+  // available already -> no need to wait
+  ASSERT_FALSE( cache.requestNotification( "target_frame", "new_frame", ros::Time(0) ) );
+
+  // open requests of a destroyed cache must not call back into it
+  {
+    TransformCache destroyed( tf );
+    ASSERT_TRUE( destroyed.requestNotification( "target_frame", "other_frame", ros::Time(0) ) );
+  }
+  stf.child_frame_id = "other_frame";
+  tf.setTransform( stf, "test", true );
+  ASSERT_EQ( 1u, cache.getNumNotifications() );
+}
+
+TEST(InteractiveMarkerClient, copy_on_demand)
+{
+  tf2_ros::Buffer tf;
+  TransformCache cache( tf );
+
+  visualization_msgs::InteractiveMarkerUpdatePtr update( new visualization_msgs::InteractiveMarkerUpdate() );
+  update->poses.resize( 1 );
+  update->poses[0].header.frame_id = "target_frame";
+  update->poses[0].header.stamp = ros::Time( 1.0 );
+  update->poses[0].pose.orientation.w = 1.0;
+
+  // nothing to transform or complete -> the message is passed on as it is
+  MessageContext<visualization_msgs::InteractiveMarkerUpdate> context( cache, "target_frame", update );
+  context.getTfTransforms();
+  ASSERT_TRUE( context.isReady() );
+  ASSERT_EQ( update.get(), context.msg.get() );
+
+  // empty orientation -> copy, the original stays untouched
+  update->poses[0].pose.orientation.w = 0.0;
+  MessageContext<visualization_msgs::InteractiveMarkerUpdate> completed( cache, "target_frame", update );
+  ASSERT_NE( update.get(), completed.msg.get() );
+  ASSERT_EQ( 1.0, completed.msg->poses[0].pose.orientation.w );
+  ASSERT_EQ( 0.0, update->poses[0].pose.orientation.w );
+
+  // a marker with controls that need no completion -> no copy either
+  visualization_msgs::InteractiveMarkerUpdatePtr full_update( new visualization_msgs::InteractiveMarkerUpdate() );
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "marker";
+  int_marker.header.frame_id = "target_frame";
+  int_marker.scale = 1.0;
+  int_marker.pose.orientation.w = 1.0;
+  visualization_msgs::InteractiveMarkerControl control;
+  control.name = "move";
+  control.orientation.w = 1.0;
+  control.interaction_mode = visualization_msgs::InteractiveMarkerControl::MOVE_AXIS;
+  visualization_msgs::Marker marker;
+  marker.ns = "marker";
+  marker.scale.x = marker.scale.y = marker.scale.z = 1.0;
+  marker.pose.orientation.w = 1.0;
+  marker.color.a = 1.0;
+  marker.id = 0;
+  control.markers.push_back( marker );
+  marker.id = 1;
+  control.markers.push_back( marker );
+  int_marker.controls.push_back( control );
+  control.name = "rotate";
+  control.interaction_mode = visualization_msgs::InteractiveMarkerControl::ROTATE_AXIS;
+  control.markers.clear();
+  marker.id = 2;
+  control.markers.push_back( marker );
+  int_marker.controls.push_back( control );
+  full_update->markers.push_back( int_marker );
+
+  ASSERT_TRUE( isAutoCompleted( int_marker ) );
+  MessageContext<visualization_msgs::InteractiveMarkerUpdate> full( cache, "target_frame", full_update );
+  full.getTfTransforms();
+  ASSERT_TRUE( full.isReady() );
+  ASSERT_EQ( full_update.get(), full.msg.get() );
+
+  // a duplicate control name has to be fixed -> copy
+  full_update->markers[0].controls[1].name = "move";
+  ASSERT_FALSE( isAutoCompleted( full_update->markers[0] ) );
+  MessageContext<visualization_msgs::InteractiveMarkerUpdate> renamed( cache, "target_frame", full_update );
+  ASSERT_NE( full_update.get(), renamed.msg.get() );
+  ASSERT_EQ( "move_u0", renamed.msg->markers[0].controls[1].name );
+  ASSERT_EQ( "move", full_update->markers[0].controls[1].name );
+}
+
 
 // Run all the tests that were declared with TEST()
 int main(int argc, char **argv)
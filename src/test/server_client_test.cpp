@@ -243,6 +243,350 @@ TEST(InteractiveMarkerServerAndClient, connect_tf_error)
   ASSERT_EQ( "marker2", update_msg->poses[0].name  );
 }
 
+TEST(InteractiveMarkerServerAndClient, lazy_init)
+{
+  tf2_ros::Buffer buffer;
+
+  interactive_markers::InteractiveMarkerServer server("im_server_client_lazy_test","test_server",false);
+  server.setLazyInitPublishing( true, 0.0 );
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "marker1";
+  int_marker.header.frame_id = "valid_frame";
+
+  // nobody is listening, so this only changes the server state
+  server.insert(int_marker);
+  server.applyChanges();
+  int_marker.name = "marker2";
+  server.insert(int_marker);
+  server.applyChanges();
+  waitMsg();
+
+  resetReceivedMsgs();
+
+  // subscribing to the init topic -> current state should be published
+  interactive_markers::InteractiveMarkerClient client(buffer, "valid_frame", "im_server_client_lazy_test");
+  client.setInitCb( &initCb );
+  client.setStatusCb( &statusCb );
+  client.setResetCb( &resetCb );
+  client.setUpdateCb( &updateCb );
+
+  // The client needs a keep-alive or update before it accepts the init message.
+  // Only the init message sent along with this update is in line with it,
+  // no matter whether the client has connected before or after it.
+  int_marker.name = "marker3";
+  server.insert(int_marker);
+  server.applyChanges();
+  for ( int i=0; i<1000 && init_calls == 0; i++ )
+  {
+    waitMsg();
+    client.update();
+  }
+
+  ASSERT_EQ( 1, init_calls  );
+  ASSERT_EQ( 0, reset_calls  );
+  ASSERT_TRUE( init_msg );
+  ASSERT_EQ( 3, init_msg->markers.size()  );
+}
+
+TEST(InteractiveMarkerServerAndClient, suppress_redundant_updates)
+{
+  tf2_ros::Buffer buffer;
+
+  interactive_markers::InteractiveMarkerServer server("im_server_client_suppress_test","test_server",false);
+  server.setSuppressRedundantUpdates( true );
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "marker1";
+  int_marker.header.frame_id = "valid_frame";
+  int_marker.pose.orientation.w = 1.0;
+  int_marker.controls.resize( 1 );
+  int_marker.controls[0].name = "control";
+
+  interactive_markers::InteractiveMarkerClient client(buffer, "valid_frame", "im_server_client_suppress_test");
+  client.setInitCb( &initCb );
+  client.setStatusCb( &statusCb );
+  client.setResetCb( &resetCb );
+  client.setUpdateCb( &updateCb );
+
+  server.insert(int_marker);
+  server.applyChanges();
+  waitMsg();
+  server.insert(int_marker);
+  server.applyChanges();
+  waitMsg();
+  client.update();
+
+  resetReceivedMsgs();
+
+  // same marker again -> nothing to send
+  server.insert(int_marker);
+  server.applyChanges();
+  waitMsg();
+  client.update();
+
+  ASSERT_EQ( 0, update_calls  );
+  ASSERT_EQ( 0, reset_calls  );
+
+  // only the pose changed -> pose update
+  int_marker.pose.position.x = 1.0;
+  server.insert(int_marker);
+  server.applyChanges();
+  waitMsg();
+  client.update();
+
+  ASSERT_EQ( 1, update_calls  );
+  ASSERT_TRUE( update_msg );
+  ASSERT_EQ( 0, update_msg->markers.size()  );
+  ASSERT_EQ( 1, update_msg->poses.size()  );
+  ASSERT_EQ( 1.0, update_msg->poses[0].pose.position.x  );
+
+  // changed contents -> full update
+  resetReceivedMsgs();
+  int_marker.controls[0].name = "other_control";
+  server.insert(int_marker);
+  server.applyChanges();
+  waitMsg();
+  client.update();
+
+  ASSERT_EQ( 1, update_calls  );
+  ASSERT_TRUE( update_msg );
+  ASSERT_EQ( 1, update_msg->markers.size()  );
+  ASSERT_EQ( "other_control", update_msg->markers[0].controls[0].name  );
+}
+
+TEST(InteractiveMarkerServerAndClient, max_update_size)
+{
+  tf2_ros::Buffer buffer;
+
+  interactive_markers::InteractiveMarkerServer server("im_server_client_chunk_test","test_server",false);
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "marker0";
+  int_marker.header.frame_id = "valid_frame";
+  int_marker.pose.orientation.w = 1.0;
+  int_marker.description = std::string( 100, 'x' );
+
+  interactive_markers::InteractiveMarkerClient client(buffer, "valid_frame", "im_server_client_chunk_test");
+  client.setInitCb( &initCb );
+  client.setStatusCb( &statusCb );
+  client.setResetCb( &resetCb );
+  client.setUpdateCb( &updateCb );
+
+  server.insert(int_marker);
+  server.applyChanges();
+  waitMsg();
+  client.update();
+
+  resetReceivedMsgs();
+
+  // room for one marker per message
+  server.setMaxUpdateSize( 300 );
+  for ( unsigned i=1; i<=5; i++ )
+  {
+    int_marker.name = "marker" + std::to_string(i);
+    server.insert(int_marker);
+  }
+  server.applyChanges();
+  waitMsg();
+  client.update();
+
+  ASSERT_EQ( 5, update_calls  );
+  ASSERT_EQ( 0, reset_calls  );
+  ASSERT_TRUE( update_msg );
+  ASSERT_EQ( 1, update_msg->markers.size()  );
+}
+
+TEST(InteractiveMarkerServerAndClient, async_publishing)
+{
+  tf2_ros::Buffer buffer;
+
+  interactive_markers::InteractiveMarkerServer server("im_server_client_async_test","test_server",false);
+  server.setAsyncPublishing( true );
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "marker0";
+  int_marker.header.frame_id = "valid_frame";
+  int_marker.pose.orientation.w = 1.0;
+
+  interactive_markers::InteractiveMarkerClient client(buffer, "valid_frame", "im_server_client_async_test");
+  client.setInitCb( &initCb );
+  client.setStatusCb( &statusCb );
+  client.setResetCb( &resetCb );
+  client.setUpdateCb( &updateCb );
+
+  server.insert(int_marker);
+  server.applyChanges();
+  server.waitForPublishing();
+  waitMsg();
+  client.update();
+
+  resetReceivedMsgs();
+
+  // consecutive updates arrive in order, without gaps in the sequence numbers
+  for ( unsigned i=1; i<=3; i++ )
+  {
+    int_marker.name = "marker" + std::to_string(i);
+    server.insert(int_marker);
+    server.applyChanges();
+  }
+  server.waitForPublishing();
+  waitMsg();
+  client.update();
+
+  ASSERT_EQ( 3, update_calls  );
+  ASSERT_EQ( 0, reset_calls  );
+  ASSERT_TRUE( update_msg );
+  ASSERT_EQ( "marker3", update_msg->markers[0].name  );
+
+  // switching back sends everything that is still queued first
+  server.erase("marker0");
+  server.applyChanges();
+  server.setAsyncPublishing( false );
+  server.erase("marker1");
+  server.applyChanges();
+  waitMsg();
+  client.update();
+
+  ASSERT_EQ( 5, update_calls  );
+  ASSERT_EQ( 0, reset_calls  );
+}
+
+TEST(InteractiveMarkerServerAndClient, separate_pose_channel)
+{
+  tf2_ros::Buffer buffer;
+
+  interactive_markers::InteractiveMarkerServer server("im_server_client_pose_channel_test","test_server",false);
+  server.setSeparatePoseChannel( true );
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "marker0";
+  int_marker.header.frame_id = "valid_frame";
+  int_marker.pose.orientation.w = 1.0;
+
+  interactive_markers::InteractiveMarkerClient client(buffer, "valid_frame", "im_server_client_pose_channel_test");
+  client.setInitCb( &initCb );
+  client.setStatusCb( &statusCb );
+  client.setResetCb( &resetCb );
+  client.setUpdateCb( &updateCb );
+
+  server.insert(int_marker);
+  server.applyChanges();
+  waitMsg();
+  client.update();
+
+  resetReceivedMsgs();
+
+  // one update is split into a pose update and a structural one
+  int_marker.pose.position.x = 1.0;
+  server.setPose( "marker0", int_marker.pose );
+  int_marker.name = "marker1";
+  server.insert(int_marker);
+  server.applyChanges();
+  for ( unsigned i=0; i<3; i++ )
+  {
+    server.setPose( "marker0", int_marker.pose );
+    server.applyChanges();
+  }
+  waitMsg();
+  client.update();
+
+  ASSERT_EQ( 5, update_calls  );
+  ASSERT_EQ( 0, reset_calls  );
+  ASSERT_TRUE( update_msg );
+  ASSERT_EQ( 1, update_msg->poses.size()  );
+  ASSERT_EQ( "marker0", update_msg->poses[0].name  );
+}
+
+TEST(InteractiveMarkerServerAndClient, tiles)
+{
+  tf2_ros::Buffer buffer;
+
+  interactive_markers::InteractiveMarkerServer server("im_server_client_tile_test","test_server",false);
+  server.setTileSize( 10.0 );
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.header.frame_id = "valid_frame";
+  int_marker.pose.orientation.w = 1.0;
+
+  int_marker.name = "near";
+  int_marker.pose.position.x = 5.0;
+  server.insert(int_marker);
+  int_marker.name = "far";
+  int_marker.pose.position.x = -15.0;
+  server.insert(int_marker);
+  server.applyChanges();
+
+  // only listen to the tile around the origin
+  interactive_markers::InteractiveMarkerClient client(buffer, "valid_frame");
+  client.setInitCb( &initCb );
+  client.setStatusCb( &statusCb );
+  client.setResetCb( &resetCb );
+  client.setUpdateCb( &updateCb );
+  client.subscribe( "im_server_client_tile_test", std::vector< std::pair<int, int> >( 1, std::make_pair( 0, 0 ) ) );
+
+  resetReceivedMsgs();
+
+  // The client needs an update or keep-alive before it accepts the init message.
+  // Wait until it is connected, the keep-alives arrive twice a second.
+  int_marker.pose.position.x = 5.0;
+  server.setPose( "near", int_marker.pose );
+  server.applyChanges();
+  for ( int i=0; i<1000 && init_calls == 0; i++ )
+  {
+    waitMsg();
+    client.update();
+  }
+
+  ASSERT_EQ( 1, init_calls  );
+  ASSERT_EQ( 0, reset_calls  );
+  ASSERT_TRUE( init_msg );
+  ASSERT_EQ( 1, init_msg->markers.size()  );
+  ASSERT_EQ( "near", init_msg->markers[0].name  );
+
+  // updates of markers in other tiles don't arrive at all
+  resetReceivedMsgs();
+  int_marker.pose.position.x = -16.0;
+  server.setPose( "far", int_marker.pose );
+  server.applyChanges();
+  waitMsg();
+  client.update();
+
+  ASSERT_EQ( 0, update_calls  );
+
+  // a marker moving into the tile is sent in full
+  int_marker.pose.position.x = 2.0;
+  server.setPose( "far", int_marker.pose );
+  server.applyChanges();
+  for ( int i=0; i<1000 && update_calls == 0; i++ )
+  {
+    waitMsg();
+    client.update();
+  }
+
+  ASSERT_EQ( 1, update_calls  );
+  ASSERT_EQ( 0, reset_calls  );
+  ASSERT_TRUE( update_msg );
+  ASSERT_EQ( 1, update_msg->markers.size()  );
+  ASSERT_EQ( "far", update_msg->markers[0].name  );
+  ASSERT_EQ( 2.0, update_msg->markers[0].pose.position.x  );
+
+  // and erased when leaving it
+  int_marker.pose.position.x = 25.0;
+  server.setPose( "near", int_marker.pose );
+  server.applyChanges();
+  for ( int i=0; i<1000 && update_calls == 1; i++ )
+  {
+    waitMsg();
+    client.update();
+  }
+
+  ASSERT_EQ( 2, update_calls  );
+  ASSERT_EQ( 0, reset_calls  );
+  ASSERT_EQ( 1, update_msg->erases.size()  );
+  ASSERT_EQ( "near", update_msg->erases[0]  );
+}
+
 
 // Run all the tests that were declared with TEST()
 int main(int argc, char **argv)
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Measures how well concurrent callers of InteractiveMarkerServer scale.
+// Several producer threads push poses of their own markers while a reader
+// thread calls get() and the main thread applies the changes at 30 Hz.
+//
+// usage: server_contention_benchmark [num_producers] [num_markers_per_producer] [seconds]
+
+#include <ros/ros.h>
+
+#include <interactive_markers/interactive_marker_server.h>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+boost::atomic<bool> done( false );
+boost::atomic<uint64_t> num_poses( 0 );
+boost::atomic<uint64_t> num_reads( 0 );
+
+std::string markerName( unsigned producer, unsigned marker )
+{
+  return "marker_" + std::to_string( producer ) + "_" + std::to_string( marker );
+}
+
+void producePoses( interactive_markers::InteractiveMarkerServer *server, unsigned producer, unsigned num_markers )
+{
+  std::vector<interactive_markers::InteractiveMarkerServer::MarkerHandle> handles;
+  for ( unsigned i = 0; i < num_markers; i++ )
+  {
+    handles.push_back( server->getHandle( markerName( producer, i ) ) );
+  }
+
+  geometry_msgs::Pose pose;
+  pose.orientation.w = 1.0;
+  uint64_t count = 0;
+  while ( !done )
+  {
+    pose.position.x = count;
+    server->setPose( handles[count % num_markers], pose );
+    count++;
+  }
+  num_poses += count;
+}
+
+void readMarkers( interactive_markers::InteractiveMarkerServer *server, unsigned num_producers, unsigned num_markers )
+{
+  visualization_msgs::InteractiveMarker int_marker;
+  uint64_t count = 0;
+  while ( !done )
+  {
+    server->get( markerName( count % num_producers, count % num_markers ), int_marker );
+    count++;
+  }
+  num_reads += count;
+}
+
+int main( int argc, char **argv )
+{
+  ros::init( argc, argv, "server_contention_benchmark" );
+
+  unsigned num_producers = argc > 1 ? atoi( argv[1] ) : 8;
+  unsigned num_markers = argc > 2 ? atoi( argv[2] ) : 100;
+  double seconds = argc > 3 ? atof( argv[3] ) : 5.0;
+  if ( num_producers == 0 || num_markers == 0 )
+  {
+    fprintf( stderr, "Need at least one producer and one marker.\n" );
+    return 1;
+  }
+
+  interactive_markers::InteractiveMarkerServer server( "server_contention_benchmark" );
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.header.frame_id = "base_link";
+  int_marker.pose.orientation.w = 1.0;
+  for ( unsigned p = 0; p < num_producers; p++ )
+  {
+    for ( unsigned i = 0; i < num_markers; i++ )
+    {
+      int_marker.name = markerName( p, i );
+      server.insert( int_marker );
+    }
+  }
+  server.applyChanges();
+
+  boost::thread_group threads;
+  for ( unsigned p = 0; p < num_producers; p++ )
+  {
+    threads.create_thread( boost::bind( &producePoses, &server, p, num_markers ) );
+  }
+  threads.create_thread( boost::bind( &readMarkers, &server, num_producers, num_markers ) );
+
+  unsigned num_applies = 0;
+  ros::WallTime start = ros::WallTime::now();
+  ros::WallRate rate( 30.0 );
+  while ( ( ros::WallTime::now() - start ).toSec() < seconds )
+  {
+    rate.sleep();
+    server.applyChanges();
+    num_applies++;
+  }
+
+  done = true;
+  threads.join_all();
+  double elapsed = ( ros::WallTime::now() - start ).toSec();
+
+  printf( "%u producers, %u markers each, %.1f s\n", num_producers, num_markers, elapsed );
+  printf( "setPose:      %12.0f calls/s\n", num_poses / elapsed );
+  printf( "get:          %12.0f calls/s\n", num_reads / elapsed );
+  printf( "applyChanges: %12.1f calls/s\n", num_applies / elapsed );
+  return 0;
+}
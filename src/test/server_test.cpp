@@ -34,8 +34,14 @@
 
 #include <interactive_markers/interactive_marker_server.h>
 
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <algorithm>
 #include <chrono>
+#include <memory>
 #include <thread>
+#include <utility>
 
 TEST(InteractiveMarkerServer, addRemove)
 {
@@ -104,6 +110,774 @@ TEST(InteractiveMarkerServer, addRemove)
   std::this_thread::sleep_for(std::chrono::microseconds(1000));
 }
 
+TEST(InteractiveMarkerServer, eraseKeepsOthers)
+{
+  interactive_markers::InteractiveMarkerServer server("im_server_test");
+
+  visualization_msgs::InteractiveMarker int_marker;
+  for ( unsigned i=0; i<3; i++ )
+  {
+    int_marker.name = "marker" + std::to_string(i);
+    int_marker.pose.position.x = i;
+    server.insert(int_marker);
+  }
+  server.applyChanges();
+  ASSERT_EQ( 3u, server.size() );
+
+  // erase a marker from the middle, then move one of the remaining ones
+  ASSERT_TRUE( server.erase( "marker0" ) );
+  server.applyChanges();
+
+  geometry_msgs::Pose pose;
+  pose.position.x = 10.0;
+  pose.orientation.w = 1.0;
+  ASSERT_TRUE( server.setPose( "marker2", pose ) );
+  server.applyChanges();
+
+  ASSERT_EQ( 2u, server.size() );
+  ASSERT_FALSE( server.get("marker0", int_marker) );
+  ASSERT_TRUE( server.get("marker1", int_marker) );
+  ASSERT_EQ( "marker1", int_marker.name );
+  ASSERT_EQ( 1.0, int_marker.pose.position.x );
+  ASSERT_TRUE( server.get("marker2", int_marker) );
+  ASSERT_EQ( "marker2", int_marker.name );
+  ASSERT_EQ( 10.0, int_marker.pose.position.x );
+
+  //avoid subscriber destruction warning
+  std::this_thread::sleep_for(std::chrono::microseconds(1000));
+}
+
+TEST(InteractiveMarkerServer, handles)
+{
+  typedef interactive_markers::InteractiveMarkerServer::MarkerHandle MarkerHandle;
+  interactive_markers::InteractiveMarkerServer server("im_server_test");
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "marker1";
+
+  geometry_msgs::Pose pose;
+  pose.position.x = 3.0;
+  pose.orientation.w = 1.0;
+
+  MarkerHandle handle = server.insert(int_marker);
+  ASSERT_NE( interactive_markers::InteractiveMarkerServer::INVALID_HANDLE, handle );
+  ASSERT_EQ( handle, server.getHandle("marker1") );
+
+  // the handle is usable before and after applying the insertion
+  ASSERT_TRUE( server.setPose( handle, pose ) );
+  server.applyChanges();
+  ASSERT_TRUE( server.get("marker1", int_marker) );
+  ASSERT_EQ( 3.0, int_marker.pose.position.x );
+
+  pose.position.x = 4.0;
+  ASSERT_TRUE( server.setPose( handle, pose ) );
+  ASSERT_TRUE( server.get("marker1", int_marker) );
+  ASSERT_EQ( 4.0, int_marker.pose.position.x );
+
+  // re-inserting keeps the handle
+  ASSERT_EQ( handle, server.insert(int_marker) );
+  server.applyChanges();
+
+  // erasing invalidates it
+  ASSERT_TRUE( server.erase( handle ) );
+  server.applyChanges();
+  ASSERT_FALSE( server.setPose( handle, pose ) );
+  ASSERT_FALSE( server.erase( handle ) );
+  ASSERT_EQ( interactive_markers::InteractiveMarkerServer::INVALID_HANDLE, server.getHandle("marker1") );
+
+  // a new marker in the same place gets a different handle
+  int_marker.name = "marker2";
+  MarkerHandle handle2 = server.insert(int_marker);
+  ASSERT_NE( handle, handle2 );
+  ASSERT_FALSE( server.setPose( handle, pose ) );
+  ASSERT_TRUE( server.setPose( handle2, pose ) );
+
+  //avoid subscriber destruction warning
+  std::this_thread::sleep_for(std::chrono::microseconds(1000));
+}
+
+TEST(InteractiveMarkerServer, setPoses)
+{
+  interactive_markers::InteractiveMarkerServer server("im_server_test");
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.header.frame_id = "old_frame";
+  std::vector<std::string> names;
+  std::vector<interactive_markers::InteractiveMarkerServer::MarkerHandle> handles;
+  for ( unsigned i=0; i<4; i++ )
+  {
+    int_marker.name = "marker" + std::to_string(i);
+    names.push_back( int_marker.name );
+    handles.push_back( server.insert(int_marker) );
+  }
+  names.push_back( "unknown" );
+  server.applyChanges();
+
+  std::vector<geometry_msgs::Pose> poses( names.size() );
+  for ( unsigned i=0; i<poses.size(); i++ )
+  {
+    poses[i].position.x = i;
+    poses[i].orientation.w = 1.0;
+  }
+
+  std_msgs::Header header;
+  header.frame_id = "new_frame";
+  ASSERT_EQ( 4u, server.setPoses( names, poses, header ) );
+
+  // a later insert supersedes the pose update
+  int_marker.name = "marker3";
+  int_marker.pose.position.x = -1.0;
+  server.insert(int_marker);
+  server.applyChanges();
+
+  for ( unsigned i=0; i<3; i++ )
+  {
+    ASSERT_TRUE( server.get(names[i], int_marker) );
+    ASSERT_EQ( i, int_marker.pose.position.x );
+    ASSERT_EQ( "new_frame", int_marker.header.frame_id );
+  }
+  ASSERT_TRUE( server.get("marker3", int_marker) );
+  ASSERT_EQ( -1.0, int_marker.pose.position.x );
+  ASSERT_EQ( "old_frame", int_marker.header.frame_id );
+
+  // by handle, keeping the header
+  poses.resize( handles.size() );
+  poses[1].position.x = 7.0;
+  ASSERT_EQ( 4u, server.setPoses( handles, poses ) );
+  server.applyChanges();
+
+  ASSERT_TRUE( server.get("marker1", int_marker) );
+  ASSERT_EQ( 7.0, int_marker.pose.position.x );
+  ASSERT_EQ( "new_frame", int_marker.header.frame_id );
+
+  // pending pose updates (not staged, due to the spatial index)
+  // show their header before they are applied
+  server.setSpatialIndex( 1.0 );
+  header.frame_id = "other_frame";
+  ASSERT_TRUE( server.setPose( "marker1", poses[1], header ) );
+  ASSERT_TRUE( server.get("marker1", int_marker) );
+  ASSERT_EQ( "other_frame", int_marker.header.frame_id );
+
+  //avoid subscriber destruction warning
+  std::this_thread::sleep_for(std::chrono::microseconds(1000));
+}
+
+TEST(InteractiveMarkerServer, getShared)
+{
+  interactive_markers::InteractiveMarkerServer server("im_server_test");
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "marker1";
+  int_marker.description = "description";
+  int_marker.pose.orientation.w = 1.0;
+
+  ASSERT_FALSE( server.getShared("marker1") );
+
+  server.insert( std::move(int_marker) );
+  visualization_msgs::InteractiveMarkerConstPtr shared = server.getShared("marker1");
+  ASSERT_TRUE( shared );
+  ASSERT_EQ( "description", shared->description );
+
+  // as long as the pose doesn't change, the marker is not copied
+  server.applyChanges();
+  ASSERT_EQ( shared, server.getShared("marker1") );
+
+  geometry_msgs::Pose pose;
+  pose.position.x = 2.0;
+  pose.orientation.w = 1.0;
+  ASSERT_TRUE( server.setPose( "marker1", pose ) );
+  shared = server.getShared("marker1");
+  ASSERT_EQ( 2.0, shared->pose.position.x );
+  ASSERT_EQ( "description", shared->description );
+
+  ASSERT_TRUE( server.erase( "marker1" ) );
+  ASSERT_FALSE( server.getShared("marker1") );
+
+  //avoid subscriber destruction warning
+  std::this_thread::sleep_for(std::chrono::microseconds(1000));
+}
+
+TEST(InteractiveMarkerServer, maxBandwidth)
+{
+  interactive_markers::InteractiveMarkerServer server("im_server_test");
+  server.setMaxBandwidth( 500 );
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.description = std::string( 100, 'x' );
+  for ( unsigned i=0; i<5; i++ )
+  {
+    int_marker.name = "marker" + std::to_string(i);
+    server.insert(int_marker);
+  }
+  server.applyChanges();
+
+  // some markers have to wait, but the server knows about all of them
+  ASSERT_LT( 0u, server.size() );
+  ASSERT_GT( 5u, server.size() );
+  for ( unsigned i=0; i<5; i++ )
+  {
+    ASSERT_TRUE( server.get("marker" + std::to_string(i), int_marker) );
+  }
+
+  // the rest is sent with the keep-alive messages
+  for ( int i=0; i<50 && server.size() < 5; i++ )
+  {
+    ros::spinOnce();
+    std::this_thread::sleep_for(std::chrono::microseconds(100000));
+  }
+  ASSERT_EQ( 5u, server.size() );
+}
+
+TEST(InteractiveMarkerServer, maxBandwidthRedundant)
+{
+  interactive_markers::InteractiveMarkerServer server("im_server_test");
+  server.setMaxBandwidth( 500 );
+  server.setSuppressRedundantUpdates( true );
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.description = std::string( 100, 'x' );
+  int_marker.name = "marker0";
+  server.insert(int_marker);
+  server.applyChanges();
+  ASSERT_EQ( 1u, server.size() );
+
+  // re-inserting it without changes doesn't use up the bandwidth
+  for ( unsigned i=0; i<3; i++ )
+  {
+    server.insert(int_marker);
+    server.applyChanges();
+  }
+
+  int_marker.name = "marker1";
+  server.insert(int_marker);
+  server.applyChanges();
+  ASSERT_EQ( 2u, server.size() );
+}
+
+TEST(InteractiveMarkerServer, clearAndEraseIf)
+{
+  interactive_markers::InteractiveMarkerServer server("im_server_test");
+
+  visualization_msgs::InteractiveMarker int_marker;
+  for ( unsigned i=0; i<4; i++ )
+  {
+    int_marker.name = "a/marker" + std::to_string(i);
+    server.insert(int_marker);
+    int_marker.name = "b/marker" + std::to_string(i);
+    server.insert(int_marker);
+  }
+  server.applyChanges();
+  ASSERT_EQ( 8u, server.size() );
+
+  ASSERT_EQ( 4u, server.erasePrefix( "a/" ) );
+  ASSERT_FALSE( server.get("a/marker0", int_marker) );
+  ASSERT_TRUE( server.get("b/marker0", int_marker) );
+  server.applyChanges();
+  ASSERT_EQ( 4u, server.size() );
+  ASSERT_EQ( 0u, server.erasePrefix( "a/" ) );
+
+  // markers inserted after clear() survive it
+  geometry_msgs::Pose pose;
+  pose.orientation.w = 1.0;
+  server.clear();
+  ASSERT_FALSE( server.get("b/marker1", int_marker) );
+  ASSERT_FALSE( server.setPose( "b/marker1", pose ) );
+  int_marker.name = "b/marker2";
+  server.insert(int_marker);
+  ASSERT_TRUE( server.setPose( "b/marker2", pose ) );
+  server.applyChanges();
+
+  ASSERT_EQ( 1u, server.size() );
+  ASSERT_FALSE( server.get("b/marker1", int_marker) );
+  ASSERT_TRUE( server.get("b/marker2", int_marker) );
+
+  //avoid subscriber destruction warning
+  std::this_thread::sleep_for(std::chrono::microseconds(1000));
+}
+
+TEST(InteractiveMarkerServer, spinThreads)
+{
+  // the spin threads are woken up rather than waiting for their timeout
+  ros::WallDuration destruction_time;
+  for ( unsigned i=0; i<5; i++ )
+  {
+    std::unique_ptr<interactive_markers::InteractiveMarkerServer> server(
+        new interactive_markers::InteractiveMarkerServer( "im_server_test", "", true, 4 ) );
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    ros::WallTime start = ros::WallTime::now();
+    server.reset();
+    destruction_time += ros::WallTime::now() - start;
+  }
+  ASSERT_LT( destruction_time.toSec(), 0.25 );
+}
+
+TEST(InteractiveMarkerServer, lifetime)
+{
+  interactive_markers::InteractiveMarkerServer server("im_server_test");
+
+  // inserted first, so that it would expire no later than the transient one
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "renewed";
+  server.insert( int_marker, ros::Duration( 0.2 ) );
+  int_marker.name = "transient";
+  server.insert( int_marker, ros::Duration( 0.2 ) );
+  int_marker.name = "permanent";
+  server.insert( int_marker, ros::Duration( 0.2 ) );
+  server.insert( int_marker );
+  server.applyChanges();
+  ASSERT_EQ( 3u, server.size() );
+
+  // far enough in the future to outlast any delay
+  int_marker.name = "renewed";
+  server.insert( int_marker, ros::Duration( 600.0 ) );
+  server.applyChanges();
+
+  // all of the short lifetimes have passed once the transient marker is gone
+  ros::WallTime deadline = ros::WallTime::now() + ros::WallDuration( 10.0 );
+  while ( server.get("transient", int_marker) && ros::WallTime::now() < deadline )
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(10000));
+    server.applyChanges();
+  }
+  ASSERT_FALSE( server.get("transient", int_marker) );
+  ASSERT_TRUE( server.get("renewed", int_marker) );
+  ASSERT_TRUE( server.get("permanent", int_marker) );
+  ASSERT_EQ( 2u, server.size() );
+
+  //avoid subscriber destruction warning
+  std::this_thread::sleep_for(std::chrono::microseconds(1000));
+}
+
+// simulated time for as long as it exists
+struct SimTime
+{
+  explicit SimTime( double time ) { set( time ); }
+  ~SimTime() { ros::Time::useSystemTime(); }
+  void set( double time ) { ros::Time::setNow( ros::Time( time ) ); }
+};
+
+TEST(InteractiveMarkerServer, lifetimeTimeJump)
+{
+  SimTime sim_time( 1000.0 );
+  interactive_markers::InteractiveMarkerServer server("im_server_test");
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "short";
+  server.insert( int_marker, ros::Duration( 5.0 ) );
+  int_marker.name = "long";
+  server.insert( int_marker, ros::Duration( 20.0 ) );
+  server.applyChanges();
+  ASSERT_EQ( 2u, server.size() );
+
+  // the simulation restarts: what is left of the lifetimes still counts
+  sim_time.set( 10.0 );
+  server.applyChanges();
+  ASSERT_EQ( 2u, server.size() );
+
+  sim_time.set( 16.0 );
+  server.applyChanges();
+  ASSERT_FALSE( server.get("short", int_marker) );
+  ASSERT_TRUE( server.get("long", int_marker) );
+
+  sim_time.set( 31.0 );
+  server.applyChanges();
+  ASSERT_EQ( 0u, server.size() );
+
+  //avoid subscriber destruction warning
+  std::this_thread::sleep_for(std::chrono::microseconds(1000));
+}
+
+// number of tiles of the server in topic_ns that are advertised
+std::size_t countTiles( const std::string &topic_ns )
+{
+  ros::master::V_TopicInfo topics;
+  ros::master::getTopics( topics );
+
+  std::string prefix = ros::NodeHandle().resolveName( topic_ns ) + "/tiles/";
+  std::string suffix = "/update";
+  std::size_t num_tiles = 0;
+  for ( std::size_t i = 0; i < topics.size(); i++ )
+  {
+    const std::string &name = topics[i].name;
+    if ( name.compare( 0, prefix.size(), prefix ) == 0 && name.size() >= prefix.size() + suffix.size() &&
+        name.compare( name.size() - suffix.size(), suffix.size(), suffix ) == 0 )
+    {
+      num_tiles++;
+    }
+  }
+  return num_tiles;
+}
+
+TEST(InteractiveMarkerServer, emptyTiles)
+{
+  interactive_markers::InteractiveMarkerServer server("im_server_tile_test");
+  server.setTileSize( 10.0, 0.0 );
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "mover";
+  int_marker.header.frame_id = "base_link";
+  int_marker.pose.orientation.w = 1.0;
+  int_marker.pose.position.x = 5.0;
+  server.insert(int_marker);
+  server.applyChanges();
+
+  // moves through four tiles
+  for ( unsigned i=1; i<4; i++ )
+  {
+    int_marker.pose.position.x = 5.0 + 10.0 * i;
+    ASSERT_TRUE( server.setPose( "mover", int_marker.pose ) );
+    server.applyChanges();
+  }
+
+  // the ones it has left are shut down with the next keep-alive
+  ros::WallTime deadline = ros::WallTime::now() + ros::WallDuration( 10.0 );
+  while ( countTiles( "im_server_tile_test" ) > 1 && ros::WallTime::now() < deadline )
+  {
+    ros::spinOnce();
+    std::this_thread::sleep_for(std::chrono::microseconds(100000));
+  }
+  ASSERT_EQ( 1u, countTiles( "im_server_tile_test" ) );
+}
+
+TEST(InteractiveMarkerServer, spatialQueries)
+{
+  interactive_markers::InteractiveMarkerServer server("im_server_test");
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.header.frame_id = "base_link";
+  int_marker.pose.orientation.w = 1.0;
+  for ( unsigned i=0; i<10; i++ )
+  {
+    int_marker.name = "marker" + std::to_string(i);
+    int_marker.pose.position.x = i;
+    server.insert(int_marker);
+  }
+  int_marker.name = "other_frame";
+  int_marker.header.frame_id = "map";
+  int_marker.pose.position.x = 2.0;
+  server.insert(int_marker);
+
+  geometry_msgs::Point min, max, center, map_center;
+  min.x = 1.5; min.y = -1.0; min.z = -1.0;
+  max.x = 4.0; max.y = 1.0; max.z = 1.0;
+  center.x = 7.0;
+  map_center.x = 2.5;
+
+  // same results with and without the index
+  for ( unsigned run=0; run<2; run++ )
+  {
+    std::vector<std::string> names;
+    ASSERT_EQ( 3u, server.queryBox( "base_link", min, max, names ) );
+    std::sort( names.begin(), names.end() );
+    ASSERT_EQ( "marker2", names[0] );
+    ASSERT_EQ( "marker4", names[2] );
+
+    names.clear();
+    ASSERT_EQ( 3u, server.queryRadius( "base_link", center, 1.0, names ) );
+    ASSERT_EQ( 1u, server.queryRadius( "map", map_center, 1.0, names ) );
+
+    server.setSpatialIndex( 1.0 );
+  }
+
+  // the index follows pose changes
+  geometry_msgs::Pose pose;
+  pose.orientation.w = 1.0;
+  pose.position.x = 3.0;
+  pose.position.y = 5.0;
+  ASSERT_TRUE( server.setPose( "marker3", pose ) );
+  server.applyChanges();
+
+  ASSERT_EQ( 2u, server.eraseInBox( "base_link", min, max ) );
+  ASSERT_FALSE( server.get("marker2", int_marker) );
+  ASSERT_TRUE( server.get("marker3", int_marker) );
+  std::vector<std::string> names;
+  ASSERT_EQ( 0u, server.queryBox( "base_link", min, max, names ) );
+
+  //avoid subscriber destruction warning
+  std::this_thread::sleep_for(std::chrono::microseconds(1000));
+}
+
+TEST(InteractiveMarkerServer, concurrentSetPose)
+{
+  interactive_markers::InteractiveMarkerServer server("im_server_test");
+
+  visualization_msgs::InteractiveMarker int_marker;
+  for ( unsigned i=0; i<8; i++ )
+  {
+    int_marker.name = "marker" + std::to_string(i);
+    server.insert(int_marker);
+  }
+  server.applyChanges();
+
+  // each thread moves its own marker, while the changes are being applied
+  std::vector<std::thread> threads;
+  for ( unsigned i=0; i<8; i++ )
+  {
+    threads.push_back( std::thread( [&server, i]()
+    {
+      geometry_msgs::Pose pose;
+      pose.orientation.w = 1.0;
+      for ( unsigned j=1; j<=1000; j++ )
+      {
+        pose.position.x = j;
+        ASSERT_TRUE( server.setPose( "marker" + std::to_string(i), pose ) );
+      }
+    } ) );
+  }
+  for ( unsigned i=0; i<10; i++ )
+  {
+    server.applyChanges();
+  }
+  for ( unsigned i=0; i<threads.size(); i++ )
+  {
+    threads[i].join();
+  }
+  server.applyChanges();
+
+  for ( unsigned i=0; i<8; i++ )
+  {
+    ASSERT_TRUE( server.get("marker" + std::to_string(i), int_marker) );
+    ASSERT_EQ( 1000.0, int_marker.pose.position.x );
+  }
+
+  //avoid subscriber destruction warning
+  std::this_thread::sleep_for(std::chrono::microseconds(1000));
+}
+
+TEST(InteractiveMarkerServer, lockFreeUpdates)
+{
+  interactive_markers::InteractiveMarkerServer server("im_server_test");
+  server.setLockFreeUpdates( true );
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "marker1";
+  server.insert(int_marker);
+  int_marker.name = "marker2";
+  server.insert(int_marker);
+  server.applyChanges();
+
+  geometry_msgs::Pose pose;
+  pose.orientation.w = 1.0;
+  pose.position.x = 1.0;
+  ASSERT_TRUE( server.setPose( "marker1", pose ) );
+  pose.position.x = 2.0;
+  ASSERT_TRUE( server.setPose( "marker1", pose ) );
+  ASSERT_TRUE( server.erase( "marker2" ) );
+
+  // queued changes are only visible once they have been applied
+  ASSERT_TRUE( server.get("marker1", int_marker) );
+  ASSERT_EQ( 0.0, int_marker.pose.position.x );
+  ASSERT_TRUE( server.get("marker2", int_marker) );
+
+  server.applyChanges();
+  ASSERT_TRUE( server.get("marker1", int_marker) );
+  ASSERT_EQ( 2.0, int_marker.pose.position.x );
+  ASSERT_FALSE( server.get("marker2", int_marker) );
+
+  // unknown markers are ignored
+  ASSERT_TRUE( server.setPose( "unknown", pose ) );
+  server.applyChanges();
+  ASSERT_EQ( 1u, server.size() );
+
+  //avoid subscriber destruction warning
+  std::this_thread::sleep_for(std::chrono::microseconds(1000));
+}
+
+// generous, so that waiting for other threads doesn't fail on a loaded machine
+const ros::WallDuration WAIT_TIMEOUT( 10.0 );
+
+void waitForSubscriber( const ros::Publisher &pub )
+{
+  ros::WallTime deadline = ros::WallTime::now() + WAIT_TIMEOUT;
+  while ( pub.getNumSubscribers() == 0 && ros::WallTime::now() < deadline )
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(10000));
+  }
+}
+
+// Holds feedback callbacks back until it is opened,
+// so that the following feedback reliably queues up behind them.
+class CallbackGate
+{
+public:
+  CallbackGate() : open_(false) {}
+
+  void open()
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    open_ = true;
+    cond_.notify_all();
+  }
+
+  void close()
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    open_ = false;
+  }
+
+  void wait()
+  {
+    boost::mutex::scoped_lock lock( mutex_ );
+    while ( !open_ )
+    {
+      cond_.wait( lock );
+    }
+  }
+
+private:
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  bool open_;
+};
+
+CallbackGate callback_gate;
+
+std::vector<uint8_t> received_events;
+boost::mutex received_events_mutex;
+
+void recordFeedback( const visualization_msgs::InteractiveMarkerFeedbackConstPtr &feedback )
+{
+  callback_gate.wait();
+  boost::mutex::scoped_lock lock( received_events_mutex );
+  received_events.push_back( feedback->event_type );
+}
+
+TEST(InteractiveMarkerServer, feedbackExecutor)
+{
+  interactive_markers::InteractiveMarkerServer server("im_server_executor_test");
+  server.setFeedbackExecutor( 2 );
+  received_events.clear();
+  callback_gate.close();
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "marker1";
+  server.insert( int_marker, &recordFeedback );
+  server.applyChanges();
+
+  ros::NodeHandle nh;
+  ros::Publisher feedback_pub = nh.advertise<visualization_msgs::InteractiveMarkerFeedback>( "im_server_executor_test/feedback", 100 );
+  waitForSubscriber( feedback_pub );
+
+  visualization_msgs::InteractiveMarkerFeedback feedback;
+  feedback.marker_name = "marker1";
+  feedback.pose.orientation.w = 1.0;
+  const uint8_t event_types[] = {
+      visualization_msgs::InteractiveMarkerFeedback::MOUSE_DOWN,
+      visualization_msgs::InteractiveMarkerFeedback::POSE_UPDATE,
+      visualization_msgs::InteractiveMarkerFeedback::POSE_UPDATE,
+      visualization_msgs::InteractiveMarkerFeedback::MOUSE_UP };
+  for ( unsigned i=0; i<4; i++ )
+  {
+    feedback.event_type = event_types[i];
+    feedback_pub.publish( feedback );
+  }
+
+  // callbacks don't block the thread receiving the feedback,
+  // all of it arrives while the first callback is still held back
+  ros::WallTime deadline = ros::WallTime::now() + WAIT_TIMEOUT;
+  while ( server.getFeedbackExecutorStats().posted < 4 && ros::WallTime::now() < deadline )
+  {
+    ros::spinOnce();
+    std::this_thread::sleep_for(std::chrono::microseconds(1000));
+  }
+  callback_gate.open();
+  ASSERT_EQ( 4u, server.getFeedbackExecutorStats().posted );
+
+  // replacing the executor waits for the remaining callbacks
+  server.setFeedbackExecutor( 0 );
+  ASSERT_EQ( 0u, server.getFeedbackExecutorStats().posted );
+  ASSERT_EQ( std::vector<uint8_t>( event_types, event_types+4 ), received_events );
+}
+
+std::vector<double> received_poses;
+
+void recordPoseFeedback( const visualization_msgs::InteractiveMarkerFeedbackConstPtr &feedback )
+{
+  callback_gate.wait();
+  boost::mutex::scoped_lock lock( received_events_mutex );
+  received_events.push_back( feedback->event_type );
+  received_poses.push_back( feedback->pose.position.x );
+}
+
+TEST(InteractiveMarkerServer, coalescePoseUpdates)
+{
+  interactive_markers::InteractiveMarkerServer server("im_server_coalesce_test");
+  server.setCoalescePoseUpdates( true );
+  received_events.clear();
+  received_poses.clear();
+  callback_gate.close();
+
+  visualization_msgs::InteractiveMarker int_marker;
+  int_marker.name = "marker1";
+  server.insert( int_marker, &recordPoseFeedback );
+  server.applyChanges();
+
+  ros::NodeHandle nh;
+  ros::Publisher feedback_pub = nh.advertise<visualization_msgs::InteractiveMarkerFeedback>( "im_server_coalesce_test/feedback", 100 );
+  waitForSubscriber( feedback_pub );
+
+  visualization_msgs::InteractiveMarkerFeedback feedback;
+  feedback.marker_name = "marker1";
+  feedback.pose.orientation.w = 1.0;
+  feedback.event_type = visualization_msgs::InteractiveMarkerFeedback::MOUSE_DOWN;
+  feedback_pub.publish( feedback );
+  feedback.event_type = visualization_msgs::InteractiveMarkerFeedback::POSE_UPDATE;
+  for ( unsigned i=0; i<20; i++ )
+  {
+    feedback.pose.position.x = i;
+    feedback_pub.publish( feedback );
+  }
+  feedback.event_type = visualization_msgs::InteractiveMarkerFeedback::MOUSE_UP;
+  feedback_pub.publish( feedback );
+
+  // the callbacks are held back, so all pose updates queue up
+  // behind MOUSE_DOWN and replace each other
+  ros::WallTime deadline = ros::WallTime::now() + WAIT_TIMEOUT;
+  while ( server.getFeedbackExecutorStats().posted < 22 && ros::WallTime::now() < deadline )
+  {
+    ros::spinOnce();
+    std::this_thread::sleep_for(std::chrono::microseconds(1000));
+  }
+  interactive_markers::InteractiveMarkerServer::FeedbackExecutorStats stats = server.getFeedbackExecutorStats();
+  callback_gate.open();
+  ASSERT_EQ( 22u, stats.posted );
+  ASSERT_EQ( 19u, stats.coalesced );
+
+  server.setFeedbackExecutor( 0 );
+
+  // mouse events are kept, and the last pose always makes it through
+  const uint8_t event_types[] = {
+      visualization_msgs::InteractiveMarkerFeedback::MOUSE_DOWN,
+      visualization_msgs::InteractiveMarkerFeedback::POSE_UPDATE,
+      visualization_msgs::InteractiveMarkerFeedback::MOUSE_UP };
+  ASSERT_EQ( std::vector<uint8_t>( event_types, event_types+3 ), received_events );
+  ASSERT_EQ( 19.0, received_poses[1] );
+
+  // removing the executor also turned coalescing off
+  server.setFeedbackExecutor( 1 );
+  callback_gate.close();
+  feedback.event_type = visualization_msgs::InteractiveMarkerFeedback::MOUSE_DOWN;
+  feedback_pub.publish( feedback );
+  feedback.event_type = visualization_msgs::InteractiveMarkerFeedback::POSE_UPDATE;
+  for ( unsigned i=0; i<5; i++ )
+  {
+    feedback_pub.publish( feedback );
+  }
+
+  deadline = ros::WallTime::now() + WAIT_TIMEOUT;
+  while ( server.getFeedbackExecutorStats().posted < 6 && ros::WallTime::now() < deadline )
+  {
+    ros::spinOnce();
+    std::this_thread::sleep_for(std::chrono::microseconds(1000));
+  }
+  stats = server.getFeedbackExecutorStats();
+  callback_gate.open();
+  server.setFeedbackExecutor( 0 );
+  ASSERT_EQ( 6u, stats.posted );
+  ASSERT_EQ( 0u, stats.coalesced );
+}
+
 
 // Run all the tests that were declared with TEST()
 int main(int argc, char **argv)
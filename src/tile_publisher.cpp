@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "interactive_markers/detail/tile_publisher.h"
+#include "interactive_markers/tools.h"
+
+#include <visualization_msgs/InteractiveMarkerInit.h>
+#include <visualization_msgs/InteractiveMarkerUpdate.h>
+
+#include <boost/make_shared.hpp>
+
+#include <algorithm>
+
+namespace interactive_markers
+{
+
+TilePublisher::TilePublisher( ros::NodeHandle &node_handle, const std::string &topic_ns,
+    const std::string &server_id, double tile_size,
+    const ros::SubscriberStatusCallback &init_connect_cb, double empty_tile_timeout ) :
+    node_handle_(node_handle),
+    topic_ns_(topic_ns),
+    server_id_(server_id),
+    tile_size_(tile_size),
+    init_connect_cb_(init_connect_cb),
+    empty_tile_timeout_(std::max( empty_tile_timeout, 0.0 ))
+{
+}
+
+boost::shared_ptr<TilePublisher::Batch> TilePublisher::route( const SharedMarkerUpdate &update )
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+
+  boost::shared_ptr<Batch> batch = boost::make_shared<Batch>();
+  boost::unordered_map<Tile*, std::size_t> batch_indices;
+
+  for ( std::size_t i = 0; i < update.erases.size(); i++ )
+  {
+    const std::string &name = update.erases[i];
+    boost::unordered_map<std::string, TilePtr>::iterator it = marker_tiles_.find( name );
+    if ( it == marker_tiles_.end() )
+    {
+      continue;
+    }
+    removeMarker( *it->second, name );
+    getMessages( it->second, *batch, batch_indices ).update.erases.push_back( name );
+    marker_tiles_.erase( it );
+  }
+
+  for ( std::size_t i = 0; i < update.poses.size(); i++ )
+  {
+    const visualization_msgs::InteractiveMarkerPose &pose = update.poses[i];
+    boost::unordered_map<std::string, TilePtr>::iterator it = marker_tiles_.find( pose.name );
+    if ( it == marker_tiles_.end() )
+    {
+      continue;
+    }
+
+    Tile &old_tile = *it->second;
+    SharedMarker &marker = old_tile.init.markers[ old_tile.marker_indices[pose.name] ];
+    marker.header = pose.header;
+    marker.pose = pose.pose;
+
+    TilePtr tile = getTile( pose.pose.position );
+    if ( tile == it->second )
+    {
+      getMessages( tile, *batch, batch_indices ).update.poses.push_back( pose );
+      continue;
+    }
+
+    // the clients of the new tile don't know the marker yet
+    SharedMarker moved = marker;
+    removeMarker( old_tile, pose.name );
+    getMessages( it->second, *batch, batch_indices ).update.erases.push_back( pose.name );
+    addMarker( *tile, moved );
+    getMessages( tile, *batch, batch_indices ).update.markers.push_back( moved );
+    it->second = tile;
+  }
+
+  for ( std::size_t i = 0; i < update.markers.size(); i++ )
+  {
+    const SharedMarker &marker = update.markers[i];
+    TilePtr tile = getTile( marker.pose.position );
+
+    TilePtr &marker_tile = marker_tiles_[marker.name()];
+    if ( marker_tile && marker_tile != tile )
+    {
+      removeMarker( *marker_tile, marker.name() );
+      getMessages( marker_tile, *batch, batch_indices ).update.erases.push_back( marker.name() );
+    }
+    marker_tile = tile;
+
+    addMarker( *tile, marker );
+    getMessages( tile, *batch, batch_indices ).update.markers.push_back( marker );
+  }
+
+  // the state is only published when it is due, see sendChangedInits()
+  ros::WallTime now = ros::WallTime::now();
+  for ( std::size_t i = 0; i < batch->size(); i++ )
+  {
+    TileMessages &messages = (*batch)[i];
+    Tile &tile = *messages.tile;
+    tile.init.seq_num++;
+    tile.init_dirty = true;
+    if ( !tile.init.markers.empty() )
+    {
+      tile.empty_since = ros::WallTime();
+    }
+    else if ( tile.empty_since.isZero() )
+    {
+      tile.empty_since = now;
+    }
+    messages.update.server_id = tile.init.server_id;
+    messages.update.seq_num = tile.init.seq_num;
+    messages.update.type = update.type;
+  }
+
+  return batch;
+}
+
+void TilePublisher::send( const boost::shared_ptr<Batch> &batch )
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+
+  for ( std::size_t i = 0; i < batch->size(); i++ )
+  {
+    TileMessages &messages = (*batch)[i];
+    messages.tile->update_pub.publish( messages.update );
+    messages.tile->sent_seq_num = messages.update.seq_num;
+  }
+}
+
+void TilePublisher::sendChangedInits()
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+
+  for ( boost::unordered_map<TileIndex, TilePtr>::iterator it = tiles_.begin(); it != tiles_.end(); ++it )
+  {
+    Tile &tile = *it->second;
+    if ( tile.init_dirty )
+    {
+      tile.init_pub.publish( tile.init );
+      tile.init_dirty = false;
+    }
+  }
+}
+
+boost::shared_ptr<TilePublisher::InitBatch> TilePublisher::takeChangedInits()
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+
+  // this only copies references to the marker contents
+  boost::shared_ptr<InitBatch> inits = boost::make_shared<InitBatch>();
+  for ( boost::unordered_map<TileIndex, TilePtr>::iterator it = tiles_.begin(); it != tiles_.end(); ++it )
+  {
+    if ( it->second->init_dirty )
+    {
+      inits->push_back( std::make_pair( it->second, it->second->init ) );
+      it->second->init_dirty = false;
+    }
+  }
+  return inits;
+}
+
+void TilePublisher::sendInits( const boost::shared_ptr<InitBatch> &inits )
+{
+  for ( std::size_t i = 0; i < inits->size(); i++ )
+  {
+    (*inits)[i].first->init_pub.publish( (*inits)[i].second );
+  }
+}
+
+void TilePublisher::sendKeepAlive()
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+
+  SharedMarkerUpdate empty_update;
+  empty_update.type = visualization_msgs::InteractiveMarkerUpdate::KEEP_ALIVE;
+
+  ros::WallTime now = ros::WallTime::now();
+  boost::unordered_map<TileIndex, TilePtr>::iterator it = tiles_.begin();
+  while ( it != tiles_.end() )
+  {
+    Tile &tile = *it->second;
+
+    // Otherwise, every tile a marker has ever passed through would stay advertised.
+    // The updates removing the markers have been sent before this.
+    if ( !tile.empty_since.isZero() && ( now - tile.empty_since ).toSec() >= empty_tile_timeout_ &&
+        tile.sent_seq_num == tile.init.seq_num )
+    {
+      tile.init_pub.publish( tile.init );
+      tile.init_pub.shutdown();
+      tile.update_pub.shutdown();
+      retired_seq_nums_[it->first] = tile.init.seq_num;
+      it = tiles_.erase( it );
+      continue;
+    }
+
+    empty_update.server_id = tile.init.server_id;
+    empty_update.seq_num = tile.sent_seq_num;
+    tile.update_pub.publish( empty_update );
+    ++it;
+  }
+}
+
+std::size_t TilePublisher::getNumTiles()
+{
+  boost::mutex::scoped_lock lock( mutex_ );
+  return tiles_.size();
+}
+
+TilePublisher::TilePtr TilePublisher::getTile( const geometry_msgs::Point &position )
+{
+  TileIndex index;
+  getTileIndex( position.x, position.y, tile_size_, index.first, index.second );
+
+  TilePtr &tile = tiles_[index];
+  if ( !tile )
+  {
+    std::string name = makeTileName( index.first, index.second );
+    std::string update_topic = topic_ns_ + "/tiles/" + name + "/update";
+
+    tile = boost::make_shared<Tile>();
+    tile->init.server_id = server_id_ + "/" + name;
+    tile->init.seq_num = 0;
+    tile->init_dirty = true;
+
+    // continue the sequence of a tile that has been shut down
+    boost::unordered_map<TileIndex, uint64_t>::iterator retired = retired_seq_nums_.find( index );
+    if ( retired != retired_seq_nums_.end() )
+    {
+      tile->init.seq_num = retired->second;
+      retired_seq_nums_.erase( retired );
+    }
+    tile->sent_seq_num = tile->init.seq_num;
+    tile->empty_since = ros::WallTime::now();
+    tile->update_pub = node_handle_.advertise<visualization_msgs::InteractiveMarkerUpdate>( update_topic, 100 );
+    tile->init_pub = node_handle_.advertise<visualization_msgs::InteractiveMarkerInit>( update_topic + "_full", 100,
+        init_connect_cb_, ros::SubscriberStatusCallback(), ros::VoidConstPtr(), true );
+  }
+  return tile;
+}
+
+TilePublisher::TileMessages& TilePublisher::getMessages( const TilePtr &tile, Batch &batch,
+    boost::unordered_map<Tile*, std::size_t> &batch_indices )
+{
+  std::pair<boost::unordered_map<Tile*, std::size_t>::iterator, bool> inserted =
+      batch_indices.insert( std::make_pair( tile.get(), batch.size() ) );
+  if ( inserted.second )
+  {
+    batch.push_back( TileMessages() );
+    batch.back().tile = tile;
+  }
+  return batch[inserted.first->second];
+}
+
+void TilePublisher::addMarker( Tile &tile, const SharedMarker &marker )
+{
+  std::pair<boost::unordered_map<std::string, std::size_t>::iterator, bool> inserted =
+      tile.marker_indices.insert( std::make_pair( marker.name(), tile.init.markers.size() ) );
+  if ( inserted.second )
+  {
+    tile.init.markers.push_back( marker );
+  }
+  else
+  {
+    tile.init.markers[inserted.first->second] = marker;
+  }
+}
+
+void TilePublisher::removeMarker( Tile &tile, const std::string &name )
+{
+  boost::unordered_map<std::string, std::size_t>::iterator it = tile.marker_indices.find( name );
+  if ( it == tile.marker_indices.end() )
+  {
+    return;
+  }
+
+  // fill the gap with the last marker
+  std::size_t index = it->second;
+  tile.marker_indices.erase( it );
+  std::vector<SharedMarker> &markers = tile.init.markers;
+  if ( index != markers.size() - 1 )
+  {
+    std::swap( markers[index], markers.back() );
+    tile.marker_indices[markers[index].name()] = index;
+  }
+  markers.pop_back();
+}
+
+}
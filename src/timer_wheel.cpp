@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "interactive_markers/detail/timer_wheel.h"
+
+#include <algorithm>
+
+namespace interactive_markers
+{
+
+TimerWheel::TimerWheel( uint64_t now ) :
+    now_(now),
+    size_(0)
+{
+}
+
+void TimerWheel::schedule( uint64_t deadline, uint64_t id )
+{
+  Entry entry;
+  // the current slot has already been processed
+  entry.deadline = std::max( deadline, now_ + 1 );
+  entry.id = id;
+  place( entry );
+  size_++;
+}
+
+void TimerWheel::advance( uint64_t now, std::vector<uint64_t> &expired )
+{
+  if ( now <= now_ )
+  {
+    return;
+  }
+
+  if ( size_ == 0 )
+  {
+    now_ = now;
+    return;
+  }
+
+  // After a large jump (e.g. simulated time starting up), going through
+  // all buckets one by one is more expensive than sorting everything out at once.
+  if ( now - now_ >= SLOTS_PER_LEVEL * SLOTS_PER_LEVEL )
+  {
+    std::vector<Entry> entries;
+    entries.reserve( size_ );
+    for ( unsigned int level = 0; level < NUM_LEVELS; level++ )
+    {
+      for ( unsigned int slot = 0; slot < SLOTS_PER_LEVEL; slot++ )
+      {
+        entries.insert( entries.end(), wheels_[level][slot].begin(), wheels_[level][slot].end() );
+        wheels_[level][slot].clear();
+      }
+    }
+    entries.insert( entries.end(), overflow_.begin(), overflow_.end() );
+    overflow_.clear();
+
+    now_ = now;
+    size_ = 0;
+    for ( std::size_t i = 0; i < entries.size(); i++ )
+    {
+      if ( entries[i].deadline <= now_ )
+      {
+        expired.push_back( entries[i].id );
+      }
+      else
+      {
+        place( entries[i] );
+        size_++;
+      }
+    }
+    return;
+  }
+
+  while ( now_ < now )
+  {
+    now_++;
+
+    // whenever the lower bits wrap around, the entries of the next slot
+    // of the level above fall into the range of the lower levels
+    for ( unsigned int level = 1; level < NUM_LEVELS; level++ )
+    {
+      if ( ( now_ & ( ( uint64_t(1) << ( level * BITS_PER_LEVEL ) ) - 1 ) ) != 0 )
+      {
+        break;
+      }
+      cascade( wheels_[level][ ( now_ >> ( level * BITS_PER_LEVEL ) ) & ( SLOTS_PER_LEVEL - 1 ) ] );
+    }
+    if ( ( now_ & ( ( uint64_t(1) << ( NUM_LEVELS * BITS_PER_LEVEL ) ) - 1 ) ) == 0 )
+    {
+      cascade( overflow_ );
+    }
+
+    // all entries in the current slot of the lowest level are due now
+    std::vector<Entry> &bucket = wheels_[0][ now_ & ( SLOTS_PER_LEVEL - 1 ) ];
+    for ( std::size_t i = 0; i < bucket.size(); i++ )
+    {
+      expired.push_back( bucket[i].id );
+    }
+    size_ -= bucket.size();
+    bucket.clear();
+  }
+}
+
+void TimerWheel::clear( uint64_t now )
+{
+  for ( unsigned int level = 0; level < NUM_LEVELS; level++ )
+  {
+    for ( unsigned int slot = 0; slot < SLOTS_PER_LEVEL; slot++ )
+    {
+      wheels_[level][slot].clear();
+    }
+  }
+  overflow_.clear();
+  now_ = now;
+  size_ = 0;
+}
+
+void TimerWheel::place( const Entry &entry )
+{
+  // the first level above which deadline and current tick are the same
+  uint64_t diff = entry.deadline ^ now_;
+  for ( unsigned int level = 0; level < NUM_LEVELS; level++ )
+  {
+    if ( ( diff >> ( level * BITS_PER_LEVEL ) ) < SLOTS_PER_LEVEL )
+    {
+      wheels_[level][ ( entry.deadline >> ( level * BITS_PER_LEVEL ) ) & ( SLOTS_PER_LEVEL - 1 ) ].push_back( entry );
+      return;
+    }
+  }
+  overflow_.push_back( entry );
+}
+
+void TimerWheel::cascade( std::vector<Entry> &bucket )
+{
+  if ( bucket.empty() )
+  {
+    return;
+  }
+
+  // place() might add to the same bucket
+  std::vector<Entry> entries;
+  entries.swap( bucket );
+  for ( std::size_t i = 0; i < entries.size(); i++ )
+  {
+    place( entries[i] );
+  }
+}
+
+}
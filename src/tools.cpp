@@ -35,6 +35,8 @@
 #include <math.h>
 #include <assert.h>
 
+#include <cstdlib>
+#include <limits>
 #include <set>
 #include <sstream>
 
@@ -80,6 +82,81 @@ void autoComplete( visualization_msgs::InteractiveMarker &msg, bool enable_autoc
   uniqueifyControlNames( msg );
 }
 
+static bool isEmpty( const geometry_msgs::Quaternion& quat )
+{
+  return quat.w == 0 && quat.x == 0 && quat.y == 0 && quat.z == 0;
+}
+
+static bool isNormalized( const geometry_msgs::Quaternion& quat )
+{
+  // normalizing again would only change the rounding
+  double length2 = quat.x*quat.x + quat.y*quat.y + quat.z*quat.z + quat.w*quat.w;
+  return fabs( length2 - 1.0 ) < 1e-6;
+}
+
+bool isAutoCompleted( const visualization_msgs::InteractiveMarker &msg, bool enable_autocomplete_transparency )
+{
+  // 'delete' messages are left alone
+  if ( msg.controls.empty() )
+  {
+    return true;
+  }
+
+  if ( msg.scale == 0 || !isNormalized( msg.pose.orientation ) )
+  {
+    return false;
+  }
+
+  std::set<std::string> control_names;
+  std::set<int32_t> marker_ids;
+  for ( unsigned c=0; c<msg.controls.size(); c++ )
+  {
+    const visualization_msgs::InteractiveMarkerControl &control = msg.controls[c];
+
+    if ( isEmpty( control.orientation ) || !control_names.insert( control.name ).second )
+    {
+      return false;
+    }
+
+    // these get default handles
+    if ( control.markers.empty() )
+    {
+      switch ( control.interaction_mode )
+      {
+        case visualization_msgs::InteractiveMarkerControl::MOVE_AXIS:
+        case visualization_msgs::InteractiveMarkerControl::MOVE_PLANE:
+        case visualization_msgs::InteractiveMarkerControl::ROTATE_AXIS:
+        case visualization_msgs::InteractiveMarkerControl::MOVE_ROTATE:
+        case visualization_msgs::InteractiveMarkerControl::MENU:
+          return false;
+
+        default:
+          break;
+      }
+    }
+
+    for ( unsigned m=0; m<control.markers.size(); m++ )
+    {
+      const visualization_msgs::Marker &marker = control.markers[m];
+
+      if ( marker.scale.x == 0 || marker.scale.y == 0 || marker.scale.z == 0 ||
+           marker.ns != msg.name ||
+           !isNormalized( marker.pose.orientation ) ||
+           !marker_ids.insert( marker.id ).second )
+      {
+        return false;
+      }
+
+      if ( !enable_autocomplete_transparency && marker.color.a > 0.0 && marker.color.a != 1.0 )
+      {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
 void uniqueifyControlNames( visualization_msgs::InteractiveMarker& msg )
 {
   int uniqueification_number = 0;
@@ -442,4 +519,34 @@ visualization_msgs::InteractiveMarkerControl makeTitle( const visualization_msgs
   return control;
 }
 
+static int tileCoordinate( double value, double tile_size )
+{
+  double index = floor( value / tile_size );
+  // also catches NaN
+  if ( !( index > std::numeric_limits<int>::min() ) )
+  {
+    return std::numeric_limits<int>::min();
+  }
+  if ( index > std::numeric_limits<int>::max() )
+  {
+    return std::numeric_limits<int>::max();
+  }
+  return static_cast<int>( index );
+}
+
+void getTileIndex( double x, double y, double tile_size, int &tile_x, int &tile_y )
+{
+  tile_x = tileCoordinate( x, tile_size );
+  tile_y = tileCoordinate( y, tile_size );
+}
+
+std::string makeTileName( int tile_x, int tile_y )
+{
+  // graph resource names can't contain '-'
+  std::ostringstream s;
+  s << "x" << ( tile_x < 0 ? "n" : "" ) << std::abs( (long long)tile_x )
+    << "_y" << ( tile_y < 0 ? "n" : "" ) << std::abs( (long long)tile_y );
+  return s.str();
+}
+
 }
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2012, Willow Garage, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the Willow Garage, Inc. nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "interactive_markers/detail/transform_cache.h"
+
+#include <tf2_msgs/TF2Error.h>
+
+#include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/make_shared.hpp>
+
+namespace interactive_markers
+{
+
+std::size_t TransformCache::KeyHash::operator()( const Key &key ) const
+{
+  std::size_t seed = 0;
+  boost::hash_combine( seed, key.target_frame );
+  boost::hash_combine( seed, key.source_frame );
+  boost::hash_combine( seed, key.time.sec );
+  boost::hash_combine( seed, key.time.nsec );
+  return seed;
+}
+
+TransformCache::TransformCache( tf2_ros::Buffer &tf ) :
+    tf_(tf),
+    state_( boost::make_shared<State>() )
+{
+  callback_handle_ = tf_.addTransformableCallback(
+      boost::bind( &TransformCache::transformableCb, state_, _1, _2, _3, _4, _5 ) );
+}
+
+TransformCache::~TransformCache()
+{
+  // also cancels the open requests. A callback that is already running
+  // only holds on to the state, not to us.
+  tf_.removeTransformableCallback( callback_handle_ );
+}
+
+TransformCache::ErrorType TransformCache::getTransform( const std::string &target_frame,
+    const std::string &source_frame, const ros::Time &time,
+    geometry_msgs::TransformStamped &transform, std::string &error )
+{
+  Key key;
+  key.target_frame = target_frame;
+  key.source_frame = source_frame;
+  key.time = time;
+
+  {
+    boost::mutex::scoped_lock lock( state_->mutex );
+    boost::unordered_map<Key, Result, KeyHash>::const_iterator it = state_->results.find( key );
+    if ( it != state_->results.end() )
+    {
+      transform = it->second.transform;
+      error = it->second.error;
+      return it->second.error_type;
+    }
+  }
+
+  // Don't block other lookups meanwhile. If another thread looks up the
+  // same transform at the same time, both results are the same anyway.
+  Result result;
+  lookup( key, result );
+
+  {
+    boost::mutex::scoped_lock lock( state_->mutex );
+    state_->results[key] = result;
+  }
+
+  transform = result.transform;
+  error = result.error;
+  return result.error_type;
+}
+
+geometry_msgs::TransformStamped TransformCache::lookupTransform( const std::string &target_frame,
+    const std::string &source_frame, const ros::Time &time )
+{
+  geometry_msgs::TransformStamped transform;
+  std::string error;
+  rethrow( getTransform( target_frame, source_frame, time, transform, error ), error );
+  return transform;
+}
+
+ros::Time TransformCache::getLatestCommonTime( const std::string &target_frame, const std::string &source_frame )
+{
+  CommonTime common_time = lookupCommonTime( target_frame, source_frame );
+  if ( common_time.error_code != tf2_msgs::TF2Error::NO_ERROR )
+  {
+    return ros::Time();
+  }
+  return common_time.time;
+}
+
+void TransformCache::clear()
+{
+  boost::mutex::scoped_lock lock( state_->mutex );
+  state_->results.clear();
+  state_->common_times.clear();
+}
+
+bool TransformCache::requestNotification( const std::string &target_frame,
+    const std::string &source_frame, const ros::Time &time )
+{
+  Key key;
+  key.target_frame = target_frame;
+  key.source_frame = source_frame;
+  key.time = time;
+
+  {
+    boost::mutex::scoped_lock lock( state_->mutex );
+    if ( state_->requests.find( key ) != state_->requests.end() )
+    {
+      return true;
+    }
+  }
+
+  // tf calls transformableCb() with its lock held, so we must not hold ours meanwhile
+  uint64_t num_notifications = state_->num_notifications;
+  tf2::TransformableRequestHandle request_handle =
+      tf_.addTransformableRequest( callback_handle_, target_frame, source_frame, time );
+
+  // 0: available by now, all bits set: too old to ever become available
+  if ( request_handle == 0 || request_handle == 0xffffffffffffffffULL )
+  {
+    return false;
+  }
+
+  boost::mutex::scoped_lock lock( state_->mutex );
+
+  // If the callback might have been called already, don't remember the request,
+  // it would never be removed. At worst, we request it again.
+  if ( state_->num_notifications != num_notifications )
+  {
+    return false;
+  }
+  state_->requests[key] = request_handle;
+  state_->request_keys[request_handle] = key;
+  return true;
+}
+
+void TransformCache::transformableCb( const StatePtr &state, tf2::TransformableRequestHandle request_handle,
+    const std::string &, const std::string &, ros::Time, tf2::TransformableResult )
+{
+  boost::mutex::scoped_lock lock( state->mutex );
+
+  boost::unordered_map<tf2::TransformableRequestHandle, Key>::iterator it = state->request_keys.find( request_handle );
+  if ( it != state->request_keys.end() )
+  {
+    state->requests.erase( it->second );
+    state->request_keys.erase( it );
+  }
+
+  // results cached before the arrival might be outdated now
+  state->results.clear();
+  state->common_times.clear();
+  state->num_notifications++;
+}
+
+void TransformCache::lookup( const Key &key, Result &result )
+{
+  result.error_type = NONE;
+
+  // Checking first is a lot cheaper than catching tf's exception,
+  // which is the common case while waiting for tf data.
+  if ( !tf_.canTransform( key.target_frame, key.source_frame, key.time, &result.error ) )
+  {
+    switch ( lookupCommonTime( key.target_frame, key.source_frame ).error_code )
+    {
+    case tf2_msgs::TF2Error::NO_ERROR:
+      result.error_type = EXTRAPOLATION;
+      break;
+    case tf2_msgs::TF2Error::LOOKUP_ERROR:
+      result.error_type = LOOKUP;
+      break;
+    default:
+      result.error_type = CONNECTIVITY;
+      break;
+    }
+    return;
+  }
+
+  // tf data might still have been dropped in the meantime
+  try
+  {
+    result.transform = tf_.lookupTransform( key.target_frame, key.source_frame, key.time );
+  }
+  catch ( const tf2::LookupException &e )
+  {
+    result.error_type = LOOKUP;
+    result.error = e.what();
+  }
+  catch ( const tf2::ConnectivityException &e )
+  {
+    result.error_type = CONNECTIVITY;
+    result.error = e.what();
+  }
+  catch ( const tf2::ExtrapolationException &e )
+  {
+    result.error_type = EXTRAPOLATION;
+    result.error = e.what();
+  }
+  catch ( const tf2::InvalidArgumentException &e )
+  {
+    result.error_type = INVALID_ARGUMENT;
+    result.error = e.what();
+  }
+  catch ( const tf2::TimeoutException &e )
+  {
+    result.error_type = TIMEOUT;
+    result.error = e.what();
+  }
+  catch ( const tf2::TransformException &e )
+  {
+    result.error_type = OTHER;
+    result.error = e.what();
+  }
+}
+
+TransformCache::CommonTime TransformCache::lookupCommonTime( const std::string &target_frame,
+    const std::string &source_frame )
+{
+  FramePair frames( target_frame, source_frame );
+
+  {
+    boost::mutex::scoped_lock lock( state_->mutex );
+    boost::unordered_map<FramePair, CommonTime>::const_iterator it = state_->common_times.find( frames );
+    if ( it != state_->common_times.end() )
+    {
+      return it->second;
+    }
+  }
+
+  CommonTime common_time;
+  tf2::CompactFrameID target_id = tf_._lookupFrameNumber( target_frame );
+  tf2::CompactFrameID source_id = tf_._lookupFrameNumber( source_frame );
+  if ( target_id == 0 || source_id == 0 )
+  {
+    common_time.error_code = tf2_msgs::TF2Error::LOOKUP_ERROR;
+  }
+  else
+  {
+    common_time.error_code = tf_._getLatestCommonTime( target_id, source_id, common_time.time, NULL );
+  }
+
+  boost::mutex::scoped_lock lock( state_->mutex );
+  state_->common_times[frames] = common_time;
+  return common_time;
+}
+
+void TransformCache::rethrow( ErrorType error_type, const std::string &error )
+{
+  switch ( error_type )
+  {
+  case NONE:
+    break;
+  case LOOKUP:
+    throw tf2::LookupException( error );
+  case CONNECTIVITY:
+    throw tf2::ConnectivityException( error );
+  case EXTRAPOLATION:
+    throw tf2::ExtrapolationException( error );
+  case INVALID_ARGUMENT:
+    throw tf2::InvalidArgumentException( error );
+  case TIMEOUT:
+    throw tf2::TimeoutException( error );
+  case OTHER:
+    throw tf2::TransformException( error );
+  }
+}
+
+}